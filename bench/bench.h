@@ -0,0 +1,36 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// Timing helpers shared by the benchmarks. Each benchmark runs its workload several times and reports the best
+// run, which is the least disturbed by the rest of the system. The numbers are only comparable between builds
+// made on the same machine.
+
+#ifndef EMBEDDED_TELNET_BENCH_H
+#define EMBEDDED_TELNET_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "EmbeddedTelnet.h"
+
+#define BENCH_ROUNDS 5
+
+static inline double bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+// Anything written is added up here, so the compiler cannot drop the work that produced it
+static volatile size_t bench_sink;
+
+static inline void bench_writer(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  bench_sink += length + ((length > 0) ? data[0] : 0);
+}
+
+#endif
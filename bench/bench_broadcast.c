@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// A 64 byte chat message with a few IAC bytes sent to 1 to 10000 sessions, half of them with NVT output
+// newlines, in ns per recipient: telnet_broadcast, which encodes the message once for each output mode, against
+// calling telnet_write for every session. The time per recipient should stay flat as the sessions grow.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define MAX_SESSIONS 10000
+#define MESSAGE_SIZE 64
+#define RECIPIENTS_PER_ROUND 200000
+
+static telnet_session_t sessions[MAX_SESSIONS];
+static telnet_session_t *list[MAX_SESSIONS];
+
+static void run(size_t count, const uint8_t *message) {
+  uint8_t buffer[4 * MESSAGE_SIZE];
+  int repeats = (int)(RECIPIENTS_PER_ROUND / count);
+  double best_broadcast = 1e300;
+  double best_writes = 1e300;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    double start = bench_now();
+    for (int r = 0; r < repeats; r++) {
+      bench_sink += telnet_broadcast(list, count, message, MESSAGE_SIZE, buffer, sizeof(buffer), bench_writer);
+    }
+    double elapsed = bench_now() - start;
+    best_broadcast = (elapsed < best_broadcast) ? elapsed : best_broadcast;
+
+    start = bench_now();
+    for (int r = 0; r < repeats; r++) {
+      for (size_t i = 0; i < count; i++) {
+        bench_sink += telnet_write(list[i], message, MESSAGE_SIZE, bench_writer);
+      }
+    }
+    elapsed = bench_now() - start;
+    best_writes = (elapsed < best_writes) ? elapsed : best_writes;
+  }
+  double recipients = (double)repeats * (double)count;
+  printf("%5zu sessions: broadcast %.1f ns/recipient, telnet_write each %.1f ns/recipient\n", count,
+         best_broadcast / recipients, best_writes / recipients);
+}
+
+int main(void) {
+  static const size_t counts[] = { 1, 10, 100, 1000, 10000 };
+  uint8_t message[MESSAGE_SIZE];
+  srand(1);
+  for (size_t i = 0; i < MESSAGE_SIZE; i++) {
+    message[i] = (i % 16 == 15) ? TELNET_IAC : (uint8_t)(' ' + rand() % 95);
+  }
+  message[MESSAGE_SIZE - 1] = '\n';
+  for (size_t i = 0; i < MAX_SESSIONS; i++) {
+    telnet_init(&sessions[i]);
+    telnet_set_output_newlines(&sessions[i], (i % 2) ? TELNET_NEWLINE_NVT : TELNET_NEWLINE_NONE);
+    list[i] = &sessions[i];
+  }
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    run(counts[i], message);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// telnet_checkpoint and telnet_restore for sessions with no options, a typical handful and every option on,
+// in ns per call, along with the size of the checkpoint. Restoring is measured both onto a session that already
+// shares the checkpoint's profile, which only checks it, and onto one that copies the options into its own
+// profile and the strings into an arena.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define REPEATS 100000
+
+static telnet_session_t session;
+static telnet_profile_t profile;
+static telnet_profile_t storage;
+
+// Set up the session as a server would, with `options` options on both sides and some of them agreed on.
+// Up to four options are the ones a server typically supports, otherwise every option is on.
+static void setup(int options) {
+  static const telnet_option_t handful[] = { TELNET_OPTION_ECHO, TELNET_OPTION_SUPPRESS_GO_AHEAD,
+                                             TELNET_OPTION_TERMINAL_TYPE, TELNET_OPTION_WINDOW_SIZE };
+  static const uint8_t terminal[] = "xterm-256color";
+  static const uint8_t location[] = "localhost";
+  telnet_profile_init(&profile);
+  for (int i = 0; i < options; i++) {
+    telnet_profile_set_option(&profile, (options <= 4) ? handful[i] : i, true);
+  }
+  if (options > 0) {
+    telnet_profile_set_subnegotiation_option(&profile, TELNET_OPTION_TERMINAL_TYPE, terminal);
+    telnet_profile_set_subnegotiation_option(&profile, TELNET_OPTION_X_DISPLAY_LOCATION, location);
+  }
+  telnet_init(&session);
+  telnet_set_profile(&session, &profile, NULL);
+  uint8_t requests[] = { TELNET_IAC, TELNET_DO, TELNET_OPTION_SUPPRESS_GO_AHEAD,
+                         TELNET_IAC, TELNET_WILL, TELNET_OPTION_TERMINAL_TYPE,
+                         TELNET_IAC, TELNET_WILL, TELNET_OPTION_WINDOW_SIZE,
+                         TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO };
+  telnet_read(&session, requests, sizeof(requests), NULL, bench_writer);
+}
+
+static void run(const char *name, int options) {
+  uint8_t checkpoint[1024];
+  uint8_t strings[256];
+  telnet_arena_t arena;
+  setup(options);
+  size_t size = telnet_checkpoint(&session, checkpoint, sizeof(checkpoint));
+
+  double best_checkpoint = 1e300;
+  double best_shared = 1e300;
+  double best_copied = 1e300;
+  telnet_session_t restored;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    double start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      bench_sink += telnet_checkpoint(&session, checkpoint, sizeof(checkpoint));
+    }
+    double elapsed = bench_now() - start;
+    best_checkpoint = (elapsed < best_checkpoint) ? elapsed : best_checkpoint;
+
+    telnet_init(&restored);
+    telnet_set_profile(&restored, &profile, NULL);
+    start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      bench_sink += telnet_restore(&restored, checkpoint, size, NULL);
+    }
+    elapsed = bench_now() - start;
+    best_shared = (elapsed < best_shared) ? elapsed : best_shared;
+
+    start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      telnet_set_profile_storage(&restored, &storage);
+      telnet_arena_init(&arena, strings, sizeof(strings));
+      bench_sink += telnet_restore(&restored, checkpoint, size, &arena);
+    }
+    elapsed = bench_now() - start;
+    best_copied = (elapsed < best_copied) ? elapsed : best_copied;
+  }
+  printf("%s: %zu bytes, checkpoint %.1f ns, restore with shared profile %.1f ns, with copied profile %.1f ns\n",
+         name, size, best_checkpoint / REPEATS, best_shared / REPEATS, best_copied / REPEATS);
+}
+
+int main(void) {
+  run("no options", 0);
+  run("4 options", 4);
+  run("256 options", 256);
+  return EXIT_SUCCESS;
+}
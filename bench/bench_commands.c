@@ -0,0 +1,100 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// telnet_read on streams that keep the parser out of its fast path, in ns per byte: a stream made almost entirely
+// of negotiations, commands, subnegotiations and escaped IAC bytes, and random data with 50% and 100% IAC bytes.
+// Built twice, as bench_commands with the switch based parser and as bench_commands_table with
+// `TELNET_TABLE_PARSER`, so the two parsers can be compared. Where hardware counters are available, compare the
+// branch misses of the two with `perf stat -e branch-misses`. Where they are not, building both with `--coverage`
+// and running `gcov -b -c` on the library counts the branches `_telnet_parse` runs.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define BUFFER_SIZE 4096
+#define REPEATS 10000
+
+#ifdef TELNET_TABLE_PARSER
+#define PARSER "table parser"
+#else
+#define PARSER "switch parser"
+#endif
+
+// Packets are refused, so only the parser and delivery are measured, not the automatic responses
+static bool refuse(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  (void)packet;
+  return false;
+}
+
+static size_t command_stream(uint8_t *data) {
+  size_t length = 0;
+  srand(2);
+  while (length < BUFFER_SIZE - 16) {
+    switch (rand() % 4) {
+      case 0:
+        data[length++] = TELNET_IAC;
+        data[length++] = (uint8_t)(TELNET_WILL + rand() % 4);
+        data[length++] = (uint8_t)(rand() % 256);
+        break;
+      case 1:
+        data[length++] = TELNET_IAC;
+        data[length++] = (uint8_t)(TELNET_NOP + rand() % 9);
+        break;
+      case 2:
+        data[length++] = TELNET_IAC;
+        data[length++] = TELNET_SB;
+        data[length++] = TELNET_OPTION_TERMINAL_TYPE;
+        data[length++] = TELNET_SE_IS;
+        memcpy(&data[length], "abcd", 4);
+        length += 4;
+        data[length++] = TELNET_IAC;
+        data[length++] = TELNET_SE;
+        break;
+      default:
+        data[length++] = 'x';
+        data[length++] = TELNET_IAC;
+        data[length++] = TELNET_IAC;
+        break;
+    }
+  }
+  return length;
+}
+
+static size_t random_stream(uint8_t *data, int density) {
+  srand(1);
+  for (size_t i = 0; i < BUFFER_SIZE; i++) {
+    data[i] = (rand() % 100 < density) ? TELNET_IAC : (uint8_t)(rand() % TELNET_IAC);
+  }
+  return BUFFER_SIZE;
+}
+
+static void run(const char *name, const uint8_t *source, size_t length) {
+  static uint8_t buffer[BUFFER_SIZE];
+  telnet_session_t session;
+  telnet_init(&session);
+  double best = 1e300;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    double start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      memcpy(buffer, source, length);
+      bench_sink += telnet_read(&session, buffer, length, refuse, bench_writer);
+    }
+    double elapsed = bench_now() - start;
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+  printf("%s, %s: %.3f ns/byte\n", PARSER, name, best / REPEATS / (double)length);
+}
+
+int main(void) {
+  static uint8_t source[BUFFER_SIZE];
+  run("command stream", source, command_stream(source));
+  run("50% IAC", source, random_stream(source, 50));
+  run("100% IAC", source, random_stream(source, 100));
+  return EXIT_SUCCESS;
+}
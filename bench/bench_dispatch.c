@@ -0,0 +1,134 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// telnet_read on a command heavy stream, in ns per byte, with the packets handed out to handlers three ways:
+// a packet callback that switches on the command and option, a dispatch table, and no handlers at all.
+// The handlers count the packets they get, and the counts must match between the callback and the table.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define BUFFER_SIZE 4096
+#define REPEATS 5000
+
+static unsigned window_size_bytes;
+static unsigned are_you_there;
+static unsigned breaks;
+
+static bool window_size_handler(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  window_size_bytes += (packet->command == TELNET_SB) ? (unsigned)packet->subnegotiation_length : 1;
+  return true;
+}
+
+static bool are_you_there_handler(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  (void)packet;
+  are_you_there++;
+  return true;
+}
+
+static bool break_handler(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  (void)packet;
+  breaks++;
+  return true;
+}
+
+// The way an application finds its handlers without a dispatch table
+static bool switch_callback(telnet_session_t *session, const telnet_packet_t *packet) {
+  switch (packet->command) {
+    case TELNET_AYT:
+      return are_you_there_handler(session, packet);
+    case TELNET_BRK:
+      return break_handler(session, packet);
+    case TELNET_SB:
+    case TELNET_WILL:
+    case TELNET_WONT:
+    case TELNET_DO:
+    case TELNET_DONT:
+      if (packet->option == TELNET_OPTION_WINDOW_SIZE) {
+        return window_size_handler(session, packet);
+      }
+      return true;
+    default:
+      return true;
+  }
+}
+
+static size_t command_stream(uint8_t *data) {
+  size_t length = 0;
+  srand(2);
+  while (length < BUFFER_SIZE - 16) {
+    switch (rand() % 4) {
+      case 0:
+        data[length++] = TELNET_IAC;
+        data[length++] = (uint8_t)(TELNET_WILL + rand() % 4);
+        data[length++] = (uint8_t)(rand() % 64);
+        break;
+      case 1:
+        data[length++] = TELNET_IAC;
+        data[length++] = (uint8_t)(TELNET_NOP + rand() % 9);
+        break;
+      case 2:
+        data[length++] = TELNET_IAC;
+        data[length++] = TELNET_SB;
+        data[length++] = (rand() % 2) ? TELNET_OPTION_WINDOW_SIZE : TELNET_OPTION_TERMINAL_TYPE;
+        data[length++] = 0;
+        memcpy(&data[length], "abcd", 4);
+        length += 4;
+        data[length++] = TELNET_IAC;
+        data[length++] = TELNET_SE;
+        break;
+      default:
+        data[length++] = 'x';
+        break;
+    }
+  }
+  return length;
+}
+
+int main(void) {
+  static const char *names[] = { "switch callback", "dispatch table", "no handlers" };
+  static uint8_t source[BUFFER_SIZE];
+  static uint8_t buffer[BUFFER_SIZE];
+  size_t length = command_stream(source);
+
+  telnet_dispatch_t dispatch;
+  telnet_dispatch_init(&dispatch);
+  telnet_dispatch_option(&dispatch, TELNET_OPTION_WINDOW_SIZE, window_size_handler);
+  telnet_dispatch_command(&dispatch, TELNET_AYT, are_you_there_handler);
+  telnet_dispatch_command(&dispatch, TELNET_BRK, break_handler);
+
+  for (int mode = 0; mode < 3; mode++) {
+    telnet_session_t session;
+    telnet_init(&session);
+    if (mode == 1) {
+      telnet_set_dispatch(&session, &dispatch);
+    }
+    telnet_packet_callback_t callback = (mode == 0) ? switch_callback : NULL;
+
+    window_size_bytes = are_you_there = breaks = 0;
+    memcpy(buffer, source, length);
+    telnet_read(&session, buffer, length, callback, bench_writer);
+    printf("%s: window size %u, are you there %u, break %u\n", names[mode], window_size_bytes, are_you_there, breaks);
+
+    double best = 1e300;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+      double start = bench_now();
+      for (int r = 0; r < REPEATS; r++) {
+        memcpy(buffer, source, length);
+        telnet_read(&session, buffer, length, callback, bench_writer);
+      }
+      double elapsed = bench_now() - start;
+      if (elapsed < best) {
+        best = elapsed;
+      }
+    }
+    printf("  %.3f ns/byte\n", best / REPEATS / (double)length);
+  }
+  return EXIT_SUCCESS;
+}
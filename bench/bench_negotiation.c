@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// A server opening a connection to a client and asking for four options, one of them the terminal type,
+// first with a telnet_write_packet call per option and then with a negotiation script. Both sides run in this
+// process and pass their output to each other. Reports how many times the server's writer is called, how many
+// exchanges it takes until the server has the terminal type, and the time for the whole opening.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define REPEATS 50000
+
+static const telnet_negotiation_t requests[] = {
+  { TELNET_WILL, TELNET_OPTION_SUPPRESS_GO_AHEAD, false },
+  { TELNET_WILL, TELNET_OPTION_ECHO, false },
+  { TELNET_DO, TELNET_OPTION_TERMINAL_TYPE, true },
+  { TELNET_DO, TELNET_OPTION_WINDOW_SIZE, false },
+};
+#define REQUEST_COUNT (sizeof(requests) / sizeof(requests[0]))
+
+static telnet_negotiation_script_t script;
+static uint8_t script_buffer[3 * REQUEST_COUNT];
+
+// Session 0 is the server and session 1 the client, each writes into the other's inbox
+static telnet_session_t sessions[2];
+static telnet_profile_t profiles[2];
+static uint8_t inbox[2][1024];
+static size_t inbox_length[2];
+static size_t writer_calls[2];
+static bool use_script;
+static bool have_terminal_type;
+
+static void deliver(telnet_session_t *session, const uint8_t *data, size_t length) {
+  int from = (session == &sessions[1]) ? 1 : 0;
+  memcpy(&inbox[1 - from][inbox_length[1 - from]], data, length);
+  inbox_length[1 - from] += length;
+  writer_calls[from]++;
+}
+
+static bool server_callback(telnet_session_t *session, const telnet_packet_t *packet) {
+  if (!use_script && packet->command == TELNET_WILL && packet->option == TELNET_OPTION_TERMINAL_TYPE) {
+    // Without a script the server has to send the query itself
+    telnet_packet_t query;
+    telnet_init_packet(&query);
+    query.command = TELNET_SB;
+    query.option = TELNET_OPTION_TERMINAL_TYPE;
+    query.subnegotiation_type = TELNET_SE_SEND;
+    telnet_write_packet(session, &query, deliver);
+  }
+  if (packet->command == TELNET_SB && packet->option == TELNET_OPTION_TERMINAL_TYPE) {
+    have_terminal_type = true;
+  }
+  return true;
+}
+
+// Open a connection, returning the number of exchanges until the server has the terminal type
+static int open_connection(void) {
+  for (int i = 0; i < 2; i++) {
+    telnet_init(&sessions[i]);
+    telnet_set_profile_storage(&sessions[i], &profiles[i]);
+    telnet_supported_options(&sessions[i], 4, TELNET_OPTION_SUPPRESS_GO_AHEAD, TELNET_OPTION_ECHO,
+                             TELNET_OPTION_TERMINAL_TYPE, TELNET_OPTION_WINDOW_SIZE);
+    inbox_length[i] = 0;
+    writer_calls[i] = 0;
+  }
+  telnet_set_subnegotiation_option(&sessions[1], TELNET_OPTION_TERMINAL_TYPE, (const uint8_t *)"xterm");
+  have_terminal_type = false;
+
+  if (use_script) {
+    telnet_start_negotiation(&sessions[0], &script, deliver);
+  } else {
+    for (size_t i = 0; i < REQUEST_COUNT; i++) {
+      telnet_packet_t packet;
+      telnet_init_packet(&packet);
+      packet.command = requests[i].command;
+      packet.option = requests[i].option;
+      telnet_write_packet(&sessions[0], &packet, deliver);
+    }
+  }
+
+  int exchanges = 0;
+  while (!have_terminal_type && (inbox_length[0] > 0 || inbox_length[1] > 0)) {
+    uint8_t buffer[1024];
+    size_t length;
+    exchanges++;
+    length = inbox_length[1];
+    memcpy(buffer, inbox[1], length);
+    inbox_length[1] = 0;
+    telnet_read(&sessions[1], buffer, length, NULL, deliver);
+    length = inbox_length[0];
+    memcpy(buffer, inbox[0], length);
+    inbox_length[0] = 0;
+    telnet_read(&sessions[0], buffer, length, server_callback, deliver);
+  }
+  return exchanges;
+}
+
+int main(void) {
+  if (!telnet_script_init(&script, requests, REQUEST_COUNT, script_buffer, sizeof(script_buffer))) {
+    return EXIT_FAILURE;
+  }
+  for (int mode = 0; mode < 2; mode++) {
+    use_script = (mode == 1);
+    int exchanges = open_connection();
+    printf("%s: %zu server writer calls, %d exchanges until the terminal type arrives\n",
+           use_script ? "negotiation script" : "packet per option", writer_calls[0], exchanges);
+    double best = 1e300;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+      double start = bench_now();
+      for (int r = 0; r < REPEATS; r++) {
+        open_connection();
+      }
+      double elapsed = bench_now() - start;
+      if (elapsed < best) {
+        best = elapsed;
+      }
+    }
+    printf("  %.0f ns per connection opening, both sides\n", best / REPEATS);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// Negotiation traffic per connection, in bytes on the wire and exchanges until both sides go quiet, between two
+// sessions that follow the RFC 1143 Q method and between two peers that answer every DO, DONT, WILL and WONT
+// without keeping any state, which is how automatic replies worked before. Both sides run in this process and pass
+// their output to each other. Stateless peers that acknowledge each other never go quiet, so they are stopped
+// after MAX_EXCHANGES exchanges.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define MAX_EXCHANGES 100
+
+// Side 0 is the server and side 1 the client, each writes into the other's inbox
+static telnet_session_t sessions[2];
+static telnet_profile_t profiles[2];
+static bool supported[2][256];
+static uint8_t inbox[2][4096];
+static size_t inbox_length[2];
+static size_t bytes_sent;
+static bool stateless;
+
+static void send_to_peer(int from, const uint8_t *data, size_t length) {
+  if (inbox_length[1 - from] + length <= sizeof(inbox[1 - from])) {
+    memcpy(&inbox[1 - from][inbox_length[1 - from]], data, length);
+    inbox_length[1 - from] += length;
+  }
+  bytes_sent += length;
+}
+
+static void deliver(telnet_session_t *session, const uint8_t *data, size_t length) {
+  send_to_peer((session == &sessions[1]) ? 1 : 0, data, length);
+}
+
+static void send_command(int from, telnet_command_t command, telnet_option_t option) {
+  if (stateless) {
+    const uint8_t request[3] = { TELNET_IAC, command, option };
+    send_to_peer(from, request, sizeof(request));
+  } else {
+    telnet_request_option(&sessions[from], command, option, deliver);
+  }
+}
+
+// Answer every negotiation in the data, accepting the supported options and refusing the rest
+static void answer_statelessly(int side, const uint8_t *data, size_t length) {
+  for (size_t i = 0; i + 2 < length; i += 3) {
+    telnet_option_t option = data[i + 2];
+    uint8_t reply[3] = { TELNET_IAC, 0, option };
+    switch (data[i + 1]) {
+      case TELNET_WILL: reply[1] = supported[side][option] ? TELNET_DO : TELNET_DONT; break;
+      case TELNET_WONT: reply[1] = TELNET_DONT; break;
+      case TELNET_DO: reply[1] = supported[side][option] ? TELNET_WILL : TELNET_WONT; break;
+      default: reply[1] = TELNET_WONT; break;
+    }
+    send_to_peer(side, reply, sizeof(reply));
+  }
+}
+
+static void setup(int side, size_t count, const telnet_option_t *options) {
+  memset(supported[side], 0, sizeof(supported[side]));
+  telnet_init(&sessions[side]);
+  telnet_set_profile_storage(&sessions[side], &profiles[side]);
+  for (size_t i = 0; i < count; i++) {
+    supported[side][options[i]] = true;
+    telnet_set_option(&sessions[side], options[i], true);
+  }
+  inbox_length[side] = 0;
+}
+
+// Pass the inboxes back and forth until both are empty, returning the number of exchanges
+static int exchange(void) {
+  int exchanges = 0;
+  while ((inbox_length[0] > 0 || inbox_length[1] > 0) && exchanges < MAX_EXCHANGES) {
+    exchanges++;
+    for (int side = 1; side >= 0; side--) {
+      uint8_t buffer[sizeof(inbox[0])];
+      size_t length = inbox_length[side];
+      memcpy(buffer, inbox[side], length);
+      inbox_length[side] = 0;
+      if (stateless) {
+        answer_statelessly(side, buffer, length);
+      } else if (length > 0) {
+        telnet_read(&sessions[side], buffer, length, NULL, deliver);
+      }
+    }
+  }
+  return exchanges;
+}
+
+// A server asking for four options from a client that supports two of them
+static int open_connection(void) {
+  static const telnet_option_t server[] = { TELNET_OPTION_ECHO, TELNET_OPTION_SUPPRESS_GO_AHEAD,
+                                            TELNET_OPTION_TERMINAL_TYPE, TELNET_OPTION_WINDOW_SIZE };
+  static const telnet_option_t client[] = { TELNET_OPTION_SUPPRESS_GO_AHEAD, TELNET_OPTION_TERMINAL_TYPE };
+  setup(0, 4, server);
+  setup(1, 2, client);
+  send_command(0, TELNET_WILL, TELNET_OPTION_ECHO);
+  send_command(0, TELNET_WILL, TELNET_OPTION_SUPPRESS_GO_AHEAD);
+  send_command(0, TELNET_DO, TELNET_OPTION_TERMINAL_TYPE);
+  send_command(0, TELNET_DO, TELNET_OPTION_WINDOW_SIZE);
+  return exchange();
+}
+
+// A client that keeps repeating requests the server has already answered, ten times over.
+// Stateless peers are still going from the opening, so that traffic is dropped first.
+static int chatty_client(void) {
+  open_connection();
+  inbox_length[0] = 0;
+  inbox_length[1] = 0;
+  static const uint8_t repeated[] = { TELNET_IAC, TELNET_DO, TELNET_OPTION_SUPPRESS_GO_AHEAD,
+                                      TELNET_IAC, TELNET_DONT, TELNET_OPTION_ECHO,
+                                      TELNET_IAC, TELNET_WILL, TELNET_OPTION_TERMINAL_TYPE };
+  bytes_sent = 0;
+  for (int i = 0; i < 10; i++) {
+    send_to_peer(1, repeated, sizeof(repeated));
+  }
+  return exchange();
+}
+
+static void run(const char *name, int (*scenario)(void)) {
+  int exchanges[2];
+  size_t bytes[2];
+  for (int mode = 0; mode < 2; mode++) {
+    stateless = (mode == 1);
+    bytes_sent = 0;
+    exchanges[mode] = scenario();
+    bytes[mode] = bytes_sent;
+  }
+  printf("%s: Q method %zu bytes in %d exchanges, stateless replies %zu bytes in %d exchanges%s\n", name, bytes[0],
+         exchanges[0], bytes[1], exchanges[1], (exchanges[1] == MAX_EXCHANGES) ? " and still going" : "");
+}
+
+int main(void) {
+  run("Opening a connection", open_connection);
+  run("Repeated requests", chatty_client);
+  return EXIT_SUCCESS;
+}
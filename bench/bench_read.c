@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// telnet_read on a 4 KB buffer with IAC bytes at increasing densities, in ns per byte.
+// Built twice, as bench_read with the vector IAC scanning the CPU supports and as bench_read_portable with
+// `TELNET_NO_SIMD`, so the two can be compared. Run against an older checkout to compare with earlier versions.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define BUFFER_SIZE 4096
+#define REPEATS 5000
+
+int main(void) {
+  static const int densities[] = { 0, 1, 10, 50, 100 };
+  static uint8_t source[BUFFER_SIZE];
+  static uint8_t buffer[BUFFER_SIZE];
+
+  for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+    srand(1);
+    for (size_t i = 0; i < BUFFER_SIZE; i++) {
+      source[i] = (rand() % 100 < densities[d]) ? TELNET_IAC : (uint8_t)(rand() % TELNET_IAC);
+    }
+
+    telnet_session_t session;
+    telnet_init(&session);
+    double best = 1e300;
+    size_t total = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+      double start = bench_now();
+      for (int r = 0; r < REPEATS; r++) {
+        memcpy(buffer, source, BUFFER_SIZE);
+        total += telnet_read(&session, buffer, BUFFER_SIZE, NULL, bench_writer);
+      }
+      double elapsed = bench_now() - start;
+      if (elapsed < best) {
+        best = elapsed;
+      }
+    }
+    printf("IAC density %3d%%: %.3f ns/byte (%zu bytes kept)\n", densities[d], best / REPEATS / BUFFER_SIZE,
+           total / BENCH_ROUNDS / REPEATS);
+  }
+  return EXIT_SUCCESS;
+}
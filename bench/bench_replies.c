@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// The cost of each automatic negotiation reply, in ns per reply. telnet_read runs on 1000 DO commands for
+// options the session does not support, each answered with WONT, and on 1000 DONT commands for options that are
+// already off, which need no answer. Both are parsed and looked up the same way, so the difference is what the
+// replies cost. For comparison, the same replies are written as packets with telnet_write_packet, which is how
+// automatic replies were sent before they were encoded directly.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define COMMANDS 1000
+#define REPEATS 2000
+
+static uint8_t answered[3 * COMMANDS];
+static uint8_t unanswered[3 * COMMANDS];
+static uint8_t buffer[3 * COMMANDS];
+static size_t replies;
+
+static void count_replies(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  (void)data;
+  replies += length / 3;
+}
+
+static double run_read(const uint8_t *source) {
+  telnet_session_t session;
+  double start = bench_now();
+  for (int r = 0; r < REPEATS; r++) {
+    telnet_init(&session);
+    memcpy(buffer, source, sizeof(buffer));
+    bench_sink += telnet_read(&session, buffer, sizeof(buffer), NULL, bench_writer);
+  }
+  return bench_now() - start;
+}
+
+int main(void) {
+  for (size_t i = 0; i < COMMANDS; i++) {
+    answered[3 * i] = TELNET_IAC;
+    answered[3 * i + 1] = TELNET_DO;
+    answered[3 * i + 2] = (uint8_t)(i % 256);
+    unanswered[3 * i] = TELNET_IAC;
+    unanswered[3 * i + 1] = TELNET_DONT;
+    unanswered[3 * i + 2] = (uint8_t)(i % 256);
+  }
+
+  // Make sure every DO is answered and no DONT is
+  telnet_session_t session;
+  telnet_init(&session);
+  memcpy(buffer, answered, sizeof(buffer));
+  telnet_read(&session, buffer, sizeof(buffer), NULL, count_replies);
+  size_t answered_replies = replies;
+  replies = 0;
+  telnet_init(&session);
+  memcpy(buffer, unanswered, sizeof(buffer));
+  telnet_read(&session, buffer, sizeof(buffer), NULL, count_replies);
+  if (answered_replies != COMMANDS || replies != 0) {
+    printf("Unexpected replies: %zu to DO, %zu to DONT\n", answered_replies, replies);
+    return EXIT_FAILURE;
+  }
+
+  double best_answered = 1e300;
+  double best_unanswered = 1e300;
+  double best_packets = 1e300;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    double elapsed = run_read(answered);
+    best_answered = (elapsed < best_answered) ? elapsed : best_answered;
+    elapsed = run_read(unanswered);
+    best_unanswered = (elapsed < best_unanswered) ? elapsed : best_unanswered;
+
+    double start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      for (size_t i = 0; i < COMMANDS; i++) {
+        telnet_packet_t packet;
+        telnet_init_packet(&packet);
+        packet.command = TELNET_WONT;
+        packet.option = (telnet_option_t)(i % 256);
+        telnet_write_packet(&session, &packet, bench_writer);
+      }
+    }
+    elapsed = bench_now() - start;
+    best_packets = (elapsed < best_packets) ? elapsed : best_packets;
+  }
+  printf("Reading a command with a reply %.1f ns, without %.1f ns: %.1f ns per automatic reply, "
+         "%.1f ns per reply written as a packet\n", best_answered / REPEATS / COMMANDS,
+         best_unanswered / REPEATS / COMMANDS, (best_answered - best_unanswered) / REPEATS / COMMANDS,
+         best_packets / REPEATS / COMMANDS);
+  return EXIT_SUCCESS;
+}
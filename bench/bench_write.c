@@ -0,0 +1,117 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// Escaping a 4 KB buffer with 0xFF bytes at 0%, 1% and 50% density, in ns per byte: telnet_escaped_length,
+// telnet_escape into a buffer sized from it, and telnet_write through a session's output buffer.
+// Built twice, as bench_write with the vector IAC counting the CPU supports and as bench_write_portable with
+// `TELNET_NO_SIMD`, so the two can be compared.
+// Then text with a bare LF every 40 bytes, written with `TELNET_NEWLINE_NVT`, which translates newlines while
+// escaping, against translating them into a second buffer first and writing that.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "bench.h"
+
+#define BUFFER_SIZE 4096
+#define REPEATS 5000
+
+static uint8_t source[BUFFER_SIZE];
+static uint8_t output[2 * BUFFER_SIZE];
+
+static double per_byte(double best) {
+  return best / REPEATS / BUFFER_SIZE;
+}
+
+static void run(int density) {
+  srand(1);
+  for (size_t i = 0; i < BUFFER_SIZE; i++) {
+    source[i] = (rand() % 100 < density) ? TELNET_IAC : (uint8_t)(rand() % TELNET_IAC);
+  }
+  telnet_session_t session;
+  telnet_init(&session);
+  telnet_set_output_buffer(&session, output, sizeof(output));
+
+  double best_length = 1e300;
+  double best_escape = 1e300;
+  double best_write = 1e300;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    double start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      bench_sink += telnet_escaped_length(source, BUFFER_SIZE);
+    }
+    double elapsed = bench_now() - start;
+    best_length = (elapsed < best_length) ? elapsed : best_length;
+
+    start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      size_t needed = telnet_escaped_length(source, BUFFER_SIZE);
+      bench_sink += telnet_escape(source, BUFFER_SIZE, output, needed);
+    }
+    elapsed = bench_now() - start;
+    best_escape = (elapsed < best_escape) ? elapsed : best_escape;
+
+    start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      telnet_write(&session, source, BUFFER_SIZE, bench_writer);
+    }
+    elapsed = bench_now() - start;
+    best_write = (elapsed < best_write) ? elapsed : best_write;
+  }
+  printf("0xFF density %2d%%: escaped_length %.3f ns/byte, escape %.3f ns/byte, write %.3f ns/byte\n", density,
+         per_byte(best_length), per_byte(best_escape), per_byte(best_write));
+}
+
+// Translate bare LFs to CR LF in a separate pass, as an application would without NVT output newlines
+static size_t translate(const uint8_t *data, size_t length, uint8_t *translated) {
+  size_t size = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == '\n' && (i == 0 || data[i - 1] != '\r')) {
+      translated[size++] = '\r';
+    }
+    translated[size++] = data[i];
+  }
+  return size;
+}
+
+static void run_newlines(void) {
+  static uint8_t translated[2 * BUFFER_SIZE];
+  srand(1);
+  for (size_t i = 0; i < BUFFER_SIZE; i++) {
+    source[i] = (i % 40 == 39) ? '\n' : (uint8_t)(' ' + rand() % 95);
+  }
+  telnet_session_t session;
+  telnet_init(&session);
+  telnet_set_output_buffer(&session, output, sizeof(output));
+
+  double best_fused = 1e300;
+  double best_separate = 1e300;
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    telnet_set_output_newlines(&session, TELNET_NEWLINE_NVT);
+    double start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      telnet_write(&session, source, BUFFER_SIZE, bench_writer);
+    }
+    double elapsed = bench_now() - start;
+    best_fused = (elapsed < best_fused) ? elapsed : best_fused;
+
+    telnet_set_output_newlines(&session, TELNET_NEWLINE_NONE);
+    start = bench_now();
+    for (int r = 0; r < REPEATS; r++) {
+      telnet_write(&session, translated, translate(source, BUFFER_SIZE, translated), bench_writer);
+    }
+    elapsed = bench_now() - start;
+    best_separate = (elapsed < best_separate) ? elapsed : best_separate;
+  }
+  printf("Text with newlines: NVT write %.3f ns/byte, translate then write %.3f ns/byte\n", per_byte(best_fused),
+         per_byte(best_separate));
+}
+
+int main(void) {
+  run(0);
+  run(1);
+  run(50);
+  run_newlines();
+  return EXIT_SUCCESS;
+}
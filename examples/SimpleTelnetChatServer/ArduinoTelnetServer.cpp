@@ -7,16 +7,19 @@
 #define YOUR_WIFI_PASSWORD "your-password"
 
 telnet_session_t session;
+telnet_profile_t profile; // The options every connection supports
 
 WiFiServer server(23); // Telnet server on port 23
 
 void setup() {
   Serial.begin(115200);
 
-  telnet_init(&session);
-  
   // Set supported options
-  telnet_supported_options(&session, TELNET_OPTION_SUPPRESS_GO_AHEAD);
+  telnet_profile_init(&profile);
+  telnet_profile_set_option(&profile, TELNET_OPTION_SUPPRESS_GO_AHEAD, true);
+
+  telnet_init(&session);
+  telnet_set_profile(&session, &profile, NULL);
 
   // Initialize WiFi
   WiFi.begin(YOUR_WIFI_SSID, YOUR_WIFI_PASSWORD);
@@ -65,7 +68,7 @@ bool handleTelnetPacket(telnet_session_t *session, const telnet_packet_t *packet
     Serial.print(" ");
     Serial.print(telnet_subnegotiation_name(packet->subnegotiation_type));
     Serial.print(" ");
-    Serial.print(packet->subnegotiation_data);
+    Serial.write(packet->subnegotiation_data, packet->subnegotiation_length);
   }
 
   Serial.print(">");
@@ -81,6 +84,7 @@ void loop() {
     if (client) {
       Serial.println("New client connected");
       telnet_init(&session);
+      telnet_set_profile(&session, &profile, NULL);
       telnet_set_user_data(&session, &client);
     }
   }
@@ -34,7 +34,9 @@ SOFTWARE.
 * and manage telnet options and subnegotiations.
 * 
 * To make it easier to use in an embedded environment, it does not use dynamic memory allocation.
-* However, a telnet session may use up to 300 bytes of memory (depending on the architecture).
+* A telnet session takes 496 bytes of memory on a 64 bit target with the default settings, plus a 464 byte
+* `telnet_profile_t` for its options unless it shares one with other sessions.
+* `TELNET_SUBNEGOTIATION_BUFFER_SIZE` and `TELNET_REPLY_BUFFER_SIZE` trim the session further.
 * 
 * To use the library, first create a `telnet_session_t` structure and initialize it with `telnet_init`.
 * ```c
@@ -58,9 +60,9 @@ SOFTWARE.
 *     printf(" %s", telnet_option_name(packet->option));
 *   }
 *   if (packet->command == TELNET_SB) {
-*     printf(" %s %s %s", telnet_option_name(packet->option),
+*     printf(" %s %s %.*s", telnet_option_name(packet->option),
 *            telnet_subnegotiation_name(packet->subnegotiation_type), 
-*            packet->subnegotiation_data);
+*            (int)packet->subnegotiation_length, packet->subnegotiation_data);
 *   }
 *   println();
 *   // Return true to indicate that we handled the packet
@@ -78,20 +80,182 @@ SOFTWARE.
 * }
 * ```
 * 
+* Telnet sends newlines as CR LF, and a carriage return on its own as CR NUL. If you would rather receive plain LF and CR,
+* call `telnet_set_input_newlines` with `TELNET_NEWLINE_NVT`. The translation is done while telnet commands are removed,
+* and is turned off while the peer is sending in BINARY mode.
+* ```c
+* telnet_set_input_newlines(&session, TELNET_NEWLINE_NVT);
+* ```
+* 
+* Likewise, `telnet_set_output_newlines` makes `telnet_write` send LF as CR LF and a bare CR as CR NUL, in the same
+* pass that escapes IAC bytes. Data that already has CR LF line endings is sent as it is. `telnet_write_length` tells
+* you exactly how many bytes will be sent.
+* ```c
+* telnet_set_output_newlines(&session, TELNET_NEWLINE_NVT);
+* ```
+*
+* If the input buffer can not be modified, use `telnet_read_into` instead. It writes the data to a separate output
+* buffer and reports how much of the input was consumed, so it can be called again if the output buffer fills up.
+* ```c
+* size_t consumed = 0;
+* while (length > 0) {
+*   size_t produced = telnet_read_into(&session, input, length, output, sizeof(output), &consumed, my_callback, my_source_writer);
+*   handle_data(output, produced);
+*   input += consumed;
+*   length -= consumed;
+* }
+* ```
+*
+* If your application already works with slices of data, `telnet_read_events` parses the input without moving any bytes.
+* It returns an ordered list of events, where data events point into the input buffer and command events describe
+* the telnet commands that were received.
+* ```c
+* telnet_event_t events[16];
+* size_t count = telnet_read_events(&session, input, length, events, 16, &consumed, my_source_writer);
+* for (size_t i = 0; i < count; i++) {
+*   if (events[i].type == TELNET_EVENT_DATA) {
+*     handle_data(events[i].data, events[i].length);
+*   }
+* }
+* ```
+*
+* Plain data between telnet commands is skipped with a scanning kernel. On x86 the kernel uses SSE2, AVX2 or AVX-512
+* depending on what the CPU supports, other platforms use a portable word-at-a-time scan.
+* Define `TELNET_NO_SIMD` when building the library to always use the portable scan.
+* Telnet commands are parsed with a switch statement by default. Define `TELNET_TABLE_PARSER` to pick the parser's next
+* step from a transition table instead, which the compiler generates from the same rules. It takes about 400 bytes of
+* read-only data and runs 5 to 10% fewer branches on input made of commands. On x86-64 both parsers run at the same speed,
+* so only use the table on a target where you have measured it to help, with `bench/bench_commands.c`.
+*
 * The library will automatically respond to telnet option requests. By default all options are set to false.
 * You can change this by calling the `telnet_supported_options` or `telnet_set_option` functions.
+* To support an option on only one side, use `telnet_set_local_option` (we answer DO with WILL) or
+* `telnet_set_remote_option` (we answer WILL with DO). Every option code from 0 to 255 can be used,
+* including MSDP (69), MCCP (86) and GMCP (201).
+* The options are kept in a `telnet_profile_t`, which a session does not have room for by default. Give it one
+* with `telnet_set_profile_storage` first, or share a profile between sessions as described below. The functions
+* that change options return false, and change nothing, when the session has nowhere to keep them.
+* **This is an API change:** earlier versions kept the options in every session. Build with
+* `TELNET_SESSION_PROFILE` set to 1 to keep doing that, at the cost of 464 bytes per session.
 * ```c
-* telnet_supported_options(&session, TELNET_OPTION_BINARY, TELNET_OPTION_SUPPRESS_GO_AHEAD);
+* static telnet_profile_t profile;
+* telnet_set_profile_storage(&session, &profile);
+* telnet_supported_options(&session, 2, TELNET_OPTION_BINARY, TELNET_OPTION_SUPPRESS_GO_AHEAD);
+* ```
+*
+* Negotiation follows the Q method from RFC 1143: the session keeps the state of each option on both sides and
+* only answers requests that change it, so two peers can never loop on WILL/WONT or DO/DONT. To ask the peer to
+* enable or disable an option yourself, call `telnet_request_option`; `telnet_local_option_enabled` and
+* `telnet_remote_option_enabled` tell you what has been agreed.
+* ```c
+* telnet_request_option(&session, TELNET_WILL, TELNET_OPTION_SUPPRESS_GO_AHEAD, my_writer);
+* telnet_request_option(&session, TELNET_DO, TELNET_OPTION_TERMINAL_TYPE, my_writer);
+* ```
+*
+* Servers usually open every connection with the same requests. Describe them once as a negotiation script and
+* `telnet_start_negotiation` sends them all in a single write. Options marked with `query` are asked for their
+* value (for example the terminal type) as soon as the client agrees to them, without a round trip through your code.
+* ```c
+* static const telnet_negotiation_t requests[] = {
+*   { TELNET_WILL, TELNET_OPTION_SUPPRESS_GO_AHEAD, false },
+*   { TELNET_WILL, TELNET_OPTION_ECHO, false },
+*   { TELNET_DO, TELNET_OPTION_TERMINAL_TYPE, true },
+*   { TELNET_DO, TELNET_OPTION_WINDOW_SIZE, false },
+* };
+* static uint8_t encoded[sizeof(requests) / sizeof(requests[0]) * 3];
+* static telnet_negotiation_script_t script;
+* telnet_script_init(&script, requests, 4, encoded, sizeof(encoded));
+*
+* telnet_supported_options(&session, 4, TELNET_OPTION_SUPPRESS_GO_AHEAD, TELNET_OPTION_ECHO,
+*                          TELNET_OPTION_TERMINAL_TYPE, TELNET_OPTION_WINDOW_SIZE);
+* telnet_start_negotiation(&session, &script, my_writer);
 * ```
 *  
 * By default, the library will not respond to subnegotiation requests but will instead call the callback function.
 * If you want to automatically respond to a subnegotiation request, you can call the
 * `telnet_set_subnegotiation_option` function. Setting a subnegotiation option to NULL will disable
 * automatic responses for that subnegotiation.
+*
+* When many sessions use the same options, set them up once in a `telnet_profile_t` and share it with
+* `telnet_set_profile`. Sessions only read a shared profile. Changing an option on one of them copies the profile
+* first, into the session's profile storage or into a block from the pool given to `telnet_set_profile`.
+* ```c
+* static telnet_profile_t profile;
+* static telnet_profile_t profile_blocks[8]; // Room for 8 sessions to change their options
+* static telnet_pool_t profile_pool;
+* telnet_pool_init(&profile_pool, profile_blocks, sizeof(telnet_profile_t), 8);
+* telnet_profile_init(&profile);
+* telnet_profile_set_option(&profile, TELNET_OPTION_SUPPRESS_GO_AHEAD, true);
+* telnet_profile_set_subnegotiation_option(&profile, TELNET_OPTION_TERMINAL_TYPE, (const uint8_t *)"xterm");
+*
+* telnet_set_profile(&session, &profile, &profile_pool);
+* ```
 * 
+* Subnegotiation data is collected in a 64 byte buffer in the session. Sessions that need more (or less) space can be
+* given their own buffer with `telnet_set_subnegotiation_buffer`, for example from a `telnet_arena_t` or `telnet_pool_t`
+* that you set aside for all of your sessions. To receive subnegotiations of any size without a buffer,
+* call `telnet_stream_subnegotiations`. The data is then passed to your callbacks in chunks as it is read, without
+* being copied into the session.
+* ```c
+* static uint8_t storage[4096];
+* telnet_arena_t arena;
+* telnet_arena_init(&arena, storage, sizeof(storage));
+* telnet_set_subnegotiation_buffer(&session, telnet_arena_alloc(&arena, 512), 512);
+*
+* // Or, for unlimited subnegotiations:
+* static const telnet_subnegotiation_stream_t stream = { my_sb_begin, my_sb_data, my_sb_end };
+* telnet_stream_subnegotiations(&session, &stream);
+* ```
+*
+* Received packets point `subnegotiation_data` at this buffer. **This is an API change:** earlier versions had a
+* 64 byte `subnegotiation_data` array inside `telnet_packet_t`, so code that wrote into it or took its `sizeof` must
+* now use `subnegotiation_length` and, when writing a subnegotiation, point `subnegotiation_data` at its payload.
+* The size of `telnet_packet_t` changed with it, so everything built against the old header must be rebuilt.
+*
+* The same goes for the other storage a session can use: the output buffer (`telnet_set_output_buffer`), the output
+* queue (`telnet_set_output_queue`), the packet batch (`telnet_set_packet_batch`) and profiles
+* (`telnet_set_profile_storage` and `telnet_set_profile`) all live in memory you provide, so they can come from an
+* arena or pool and be sized for what each connection needs. The state of the queue and the batch is kept with them,
+* in a `telnet_output_queue_t` and a `telnet_packet_batch_t`, so a session that uses neither does not pay for them.
+* The library has no line buffer of its own; collect lines in your application.
+*
+* If you would rather handle all packets from one read together, call `telnet_set_packet_batch` with an array of packets.
+* The packets received by each call to `telnet_read` are then collected in the array and passed to a single callback.
+* ```c
+* telnet_packet_t packets[16];
+* telnet_packet_batch_t batch;
+* telnet_set_packet_batch(&session, &batch, packets, 16, my_batch_callback);
+* ```
+*
+* Instead of switching on the command and option in one callback, handlers can be registered for individual
+* options and commands in a `telnet_dispatch_t`. The table is shared by all sessions that use it, and packets
+* without a handler still go to the packet callback.
+* ```c
+* static telnet_dispatch_t dispatch;
+* telnet_dispatch_init(&dispatch);
+* telnet_dispatch_option(&dispatch, TELNET_OPTION_WINDOW_SIZE, my_naws_handler);
+* telnet_dispatch_command(&dispatch, TELNET_AYT, my_ayt_handler);
+*
+* telnet_set_dispatch(&session, &dispatch);
+* ```
+*
 * If you do not provide a callback function to `telnet_read`, the library will automatically respond to
 * telnet options and subnegotiation requests when it can, but other packets will be ignored.
 *
+* A session can be moved to another process with `telnet_checkpoint` and `telnet_restore`. The checkpoint holds the
+* parser and option state, but not the user data, callbacks or buffers, which you set up again before restoring.
+* Option sets are stored sparsely, so the state takes 26 bytes with no options and at most 282 bytes with all of
+* them, plus the subnegotiation option strings and any partly received subnegotiation. A session with a handful
+* of options is well under 128 bytes; call `telnet_checkpoint` with a NULL buffer to get the exact size.
+* ```c
+* uint8_t checkpoint[512];
+* size_t size = telnet_checkpoint(&session, checkpoint, sizeof(checkpoint)); // 0 if it does not fit
+* // ... in the other process
+* telnet_init(&session);
+* telnet_set_user_data(&session, my_data);
+* telnet_restore(&session, checkpoint, size, &arena);
+* ```
+*
 * To write data to a telnet session, use the `telnet_write` function. This function will escape data as necessary
 * to conform to the telnet protocol.
 * ```c
@@ -116,6 +280,7 @@ extern "C" {
 */
 
 // Telnet commands
+#define TELNET_EOR   239 /* 0xEF End Of Record */
 #define TELNET_SE    240 /* 0xF0 Subnegotiation End */
 #define TELNET_NOP   241 /* 0xF1 No Operation */
 #define TELNET_DM    242 /* 0xF2 Data Mark */
@@ -192,40 +357,108 @@ typedef int telnet_option_t;
 
 #define TELNET_MAX_OPTIONS 50
 
+/**
+* Size of the subnegotiation buffer that is built into each session.
+* Sessions that need a different size can be given their own buffer with `telnet_set_subnegotiation_buffer`.
+* Define this as 0 to leave the buffer out of the session entirely.
+*/
+#ifndef TELNET_SUBNEGOTIATION_BUFFER_SIZE
+#define TELNET_SUBNEGOTIATION_BUFFER_SIZE 64
+#endif
+
+/**
+* Size of the buffer each session collects automatic replies in, so the replies to one read are written together.
+* The default holds 16 replies. Define this as 0 to write each reply as soon as it is made.
+*/
+#ifndef TELNET_REPLY_BUFFER_SIZE
+#define TELNET_REPLY_BUFFER_SIZE 48
+#endif
+
+/**
+* Size of the buffer `telnet_write` uses on the stack when the session does not have an output buffer.
+* Writes that fit in the buffer once escaped are passed to the writer in a single call.
+*/
+#ifndef TELNET_WRITE_BUFFER_SIZE
+#define TELNET_WRITE_BUFFER_SIZE 128
+#endif
+
+/**
+* Number of segments `telnet_writev` passes to the vector writer at a time.
+*/
+#ifndef TELNET_WRITEV_SEGMENTS
+#define TELNET_WRITEV_SEGMENTS 16
+#endif
+
+/**
+* Set to 1 to build a profile into each session, so options can be changed on any session without first giving it
+* storage with `telnet_set_profile_storage` or a pool with `telnet_set_profile`. This makes every session
+* `sizeof(telnet_profile_t)` bytes larger, which is wasted on sessions that share a profile, so it is off by default.
+*/
+#ifndef TELNET_SESSION_PROFILE
+#define TELNET_SESSION_PROFILE 0
+#endif
+
+/**
+* Number of different handlers a `telnet_dispatch_t` can hold, at most 255.
+* Options and commands that share a handler only use one entry.
+*/
+#ifndef TELNET_DISPATCH_HANDLERS
+#define TELNET_DISPATCH_HANDLERS 16
+#endif
+#if TELNET_DISPATCH_HANDLERS > 255
+#error "TELNET_DISPATCH_HANDLERS must be at most 255, handlers are found through one byte slots"
+#endif
+
 #define TELNET_STATE_READY                    0
 #define TELNET_STATE_IN_COMMAND               1
 #define TELNET_STATE_IN_OPTION                2
 #define TELNET_STATE_IN_SUBNEGOTIATION_TYPE   3
 #define TELNET_STATE_IN_SUBNEGOTIATION_VALUE  4
 #define TELNET_STATE_IN_SB_IAC                5
+#define TELNET_STATE_IN_SUBNEGOTIATION_OPTION 6
 typedef int telnet_parse_state_t;
 
 /** 
 * Structure representing a telnet command packet.
 * This structure is used to encapsulate the command type and any associated data.
-* We limit the subnegotiation data to 64 bytes to prevent the need for memory allocation.
+* For received packets, the subnegotiation data points into the session's subnegotiation buffer and is only valid
+* until the next subnegotiation is received.
+* When writing a subnegotiation packet, point the subnegotiation data at the payload to send.
 */
 typedef struct {
   telnet_command_t command;
   telnet_option_t option;
   telnet_subnegotiation_t subnegotiation_type;
   size_t subnegotiation_length;
-  uint8_t subnegotiation_data[64];
+  const uint8_t *subnegotiation_data;
 } telnet_packet_t;
 
+#define TELNET_NEWLINE_NONE 0 /* Newlines are passed through unchanged */
+#define TELNET_NEWLINE_NVT  1 /* NVT newlines, CR LF and CR NUL on the wire */
+typedef int telnet_newline_t;
+
+#define TELNET_EVENT_DATA                 0
+#define TELNET_EVENT_COMMAND              1
+#define TELNET_EVENT_SUBNEGOTIATION_DATA  2
+typedef int telnet_event_type_t;
+
 /**
-* This structure holds the state of a telnet session.
-* You can use the `telnet_set_user_data` to store any user-specific data you need to associate with the session.
-* If you call `telnet_set_automatic_response`, the session will automatically respond to option and subnegotiation requests with the options provided.
-* Please do not modify the value of this struct directly; use the provided functions to manage its state.
+* Structure representing an event produced by `telnet_read_events`.
+* Data events point into the buffer that was passed to `telnet_read_events`, so they are only valid as long as that buffer is.
+* `TELNET_EVENT_DATA` is a span of application data.
+* `TELNET_EVENT_SUBNEGOTIATION_DATA` is a span of data from the subnegotiation that is currently being received.
+* `TELNET_EVENT_COMMAND` is a complete telnet command. For `TELNET_SB` it follows the subnegotiation data it belongs to.
 */
 typedef struct {
-  telnet_parse_state_t state;
-  telnet_packet_t packet;
-  uint64_t options;
-  const uint8_t *subnegotiation_options[TELNET_MAX_OPTIONS];
-  void *user_data; 
-} telnet_session_t;
+  telnet_event_type_t type;
+  const uint8_t *data;
+  size_t length;
+  telnet_command_t command;
+  telnet_option_t option;
+  telnet_subnegotiation_t subnegotiation_type;
+} telnet_event_t;
+
+typedef struct telnet_session_t telnet_session_t;
 
 /**
 * Callback function type for handling telnet packets.
@@ -238,6 +471,229 @@ typedef struct {
 */
 typedef bool (*telnet_packet_callback_t)(telnet_session_t *session, const telnet_packet_t *packet);
 
+/**
+* A table of packet handlers for individual options and commands, set up with `telnet_dispatch_init`,
+* `telnet_dispatch_option` and `telnet_dispatch_command` and shared by any number of sessions.
+* Each option and command maps to a one byte slot, slot 0 meaning no handler, so finding the handler for a packet
+* is two table lookups. Please do not modify the value of this struct directly.
+*/
+typedef struct {
+  uint8_t option_slots[256];
+  uint8_t command_slots[16]; /* Commands from TELNET_EOR to TELNET_DONT */
+  telnet_packet_callback_t handlers[TELNET_DISPATCH_HANDLERS + 1];
+  size_t count;
+} telnet_dispatch_t;
+
+/**
+* Callback function type for the start of a streamed subnegotiation.
+* 
+* @param session The current telnet session.
+* @param option The option the subnegotiation is for.
+* @param subnegotiation_type The subnegotiation type, such as `TELNET_SE_SEND`.
+*/
+typedef void (*telnet_subnegotiation_begin_t)(telnet_session_t *session, telnet_option_t option, telnet_subnegotiation_t subnegotiation_type);
+
+/**
+* Callback function type for data of a streamed subnegotiation.
+* This may be called any number of times between the begin and end callbacks.
+* The data points into the buffer passed to `telnet_read` and is only valid during the call.
+* 
+* @param session The current telnet session.
+* @param data The next chunk of subnegotiation data.
+* @param length The length of the chunk.
+*/
+typedef void (*telnet_subnegotiation_data_t)(telnet_session_t *session, const uint8_t *data, size_t length);
+
+/**
+* The callbacks that receive streamed subnegotiations, see `telnet_stream_subnegotiations`.
+* One set of callbacks can be shared by any number of sessions.
+*/
+typedef struct {
+  telnet_subnegotiation_begin_t begin; /* Called at the start of a subnegotiation, may be NULL */
+  telnet_subnegotiation_data_t data;   /* Called with the subnegotiation data as it arrives */
+  telnet_packet_callback_t end;        /* Called at the end of a subnegotiation, may be NULL */
+} telnet_subnegotiation_stream_t;
+
+/**
+* Callback function type for handling a batch of telnet packets.
+* In batch mode, this function is called once per call to `telnet_read` with all packets received during that call.
+* 
+* @param session The current telnet session.
+* @param packets The received telnet packets, in the order they were received.
+* @param count The number of packets.
+*/
+typedef void (*telnet_packet_batch_callback_t)(telnet_session_t *session, const telnet_packet_t *packets, size_t count);
+
+/**
+* The state of a session's packet batch, see `telnet_set_packet_batch`.
+* Please do not modify the value of this struct directly.
+*/
+typedef struct {
+  telnet_packet_t *packets;
+  size_t capacity;
+  size_t count;
+  bool has_subnegotiation;
+  telnet_packet_batch_callback_t callback;
+} telnet_packet_batch_t;
+
+#define TELNET_OUTPUT_HIGH_WATERMARK 0 /* The output queue has filled up to its high watermark */
+#define TELNET_OUTPUT_LOW_WATERMARK  1 /* The output queue has drained down to its low watermark */
+#define TELNET_OUTPUT_OVERFLOW       2 /* Output was refused because the output queue is full */
+typedef int telnet_output_event_t;
+
+/**
+* Callback function type for output queue notifications.
+* 
+* @param session The current telnet session.
+* @param event What happened, such as `TELNET_OUTPUT_HIGH_WATERMARK`.
+*/
+typedef void (*telnet_output_callback_t)(telnet_session_t *session, telnet_output_event_t event);
+
+/**
+* The state of a session's output queue, see `telnet_set_output_queue`.
+* Please do not modify the value of this struct directly.
+*/
+typedef struct {
+  uint8_t *storage;
+  size_t capacity;
+  size_t head;
+  size_t length;
+  size_t low_watermark;
+  size_t high_watermark;
+  bool above_high_watermark;
+  telnet_output_callback_t callback;
+} telnet_output_queue_t;
+
+/**
+* When output written with `telnet_write` is held back before it is passed to the writer.
+* Output is collected in the session's output buffer (see `telnet_set_output_buffer`) and sent when any of these happen:
+* the buffer fills, `size_threshold` bytes are waiting, `max_delay` has passed according to `telnet_poll`,
+* a GA or EOR prompt is written and `flush_on_prompt` is set, or `telnet_flush` is called.
+* Automatic replies are never held: they are sent at the end of the read that caused them, after any held output.
+* A policy can be shared by any number of sessions.
+*/
+typedef struct {
+  size_t size_threshold; /* Send once this many bytes are waiting, 0 to wait until the buffer is full */
+  uint32_t max_delay; /* Longest time output waits, in the units passed to `telnet_poll` */
+  bool flush_on_prompt; /* Send as soon as a GA or EOR is written */
+} telnet_flush_policy_t;
+
+/**
+* Number of 32 bit words in a bitmap with one bit for each of the 256 telnet options.
+*/
+#define TELNET_OPTION_WORDS 8
+
+/**
+* The negotiated state of one side of every option, kept as bitmaps indexed by option number.
+* Each option is in one of the four states from the RFC 1143 Q method: NO, YES, WANTNO (`yes` and `pending`)
+* or WANTYES (`pending` only). The `opposite` bit records a request to change the option back once the current
+* negotiation finishes.
+*/
+typedef struct {
+  uint32_t yes[TELNET_OPTION_WORDS];
+  uint32_t pending[TELNET_OPTION_WORDS];
+  uint32_t opposite[TELNET_OPTION_WORDS];
+} telnet_option_state_t;
+
+/**
+* One step of a negotiation script: an option to request when the session starts.
+*/
+typedef struct {
+  telnet_command_t command; /* TELNET_WILL to offer the option or TELNET_DO to ask the peer for it */
+  telnet_option_t option;
+  bool query; /* After the peer agrees to a DO, send IAC SB option SEND IAC SE */
+} telnet_negotiation_t;
+
+/**
+* The options a session asks for as soon as it starts, encoded once by `telnet_script_init` and shared by any
+* number of sessions. Please do not modify the value of this struct directly.
+*/
+typedef struct {
+  const telnet_negotiation_t *requests;
+  size_t count;
+  const uint8_t *encoded;
+  size_t length;
+  uint32_t queries[TELNET_OPTION_WORDS];
+} telnet_negotiation_script_t;
+
+/**
+* A simple arena for handing out storage to telnet sessions.
+* The arena uses a buffer provided by the application and never frees individual allocations.
+* Use `telnet_arena_reset` to release everything at once.
+*/
+typedef struct {
+  uint8_t *buffer;
+  size_t capacity;
+  size_t used;
+} telnet_arena_t;
+
+/**
+* A pool of fixed size blocks for handing out storage to telnet sessions.
+* The pool uses a buffer provided by the application, blocks can be returned to the pool with `telnet_pool_free`.
+*/
+typedef struct {
+  size_t block_size;
+  void *free_list;
+} telnet_pool_t;
+
+/**
+* The options a session supports and the values it sends for subnegotiation requests.
+* A profile set up once with `telnet_profile_init` and the `telnet_profile_set_*` functions can be shared by any
+* number of sessions with `telnet_set_profile`. Sessions never change a shared profile: changing an option on such a
+* session first copies the profile (copy on write). Please do not modify the value of this struct directly.
+*/
+typedef struct {
+  uint32_t local_supported[TELNET_OPTION_WORDS];
+  uint32_t remote_supported[TELNET_OPTION_WORDS];
+  const uint8_t *subnegotiation_options[TELNET_MAX_OPTIONS];
+} telnet_profile_t;
+
+/**
+* This structure holds the state of a telnet session.
+* You can use the `telnet_set_user_data` to store any user-specific data you need to associate with the session.
+* The session automatically responds to option and subnegotiation requests using the options in its profile.
+* Please do not modify the value of this struct directly; use the provided functions to manage its state.
+*/
+struct telnet_session_t {
+  telnet_parse_state_t state;
+  uint32_t flags;
+  telnet_packet_t packet;
+  const telnet_profile_t *profile;
+  telnet_profile_t *profile_copy;
+  telnet_pool_t *profile_pool;
+  telnet_profile_t *profile_storage;
+#if TELNET_SESSION_PROFILE
+  telnet_profile_t profile_builtin;
+#endif
+  telnet_option_state_t local_options;
+  telnet_option_state_t remote_options;
+  const telnet_negotiation_script_t *negotiation_script;
+  const telnet_subnegotiation_stream_t *subnegotiation_stream;
+  uint8_t *subnegotiation_buffer;
+  size_t subnegotiation_capacity;
+#if TELNET_SUBNEGOTIATION_BUFFER_SIZE > 0
+  uint8_t subnegotiation_storage[TELNET_SUBNEGOTIATION_BUFFER_SIZE];
+#endif
+  telnet_packet_batch_t *packet_batch;
+  const telnet_dispatch_t *dispatch;
+  telnet_newline_t input_newlines;
+  telnet_newline_t output_newlines;
+  uint8_t *output_buffer;
+  size_t output_capacity;
+  size_t output_length;
+  const telnet_flush_policy_t *flush_policy;
+  uint32_t output_clock;
+  uint32_t output_deadline;
+#if TELNET_REPLY_BUFFER_SIZE >= 3
+  uint8_t reply_buffer[TELNET_REPLY_BUFFER_SIZE];
+#endif
+  size_t reply_length;
+  telnet_output_queue_t *output_queue;
+  void *user_data; 
+};
+
+
+
 /**
 * Callback function type for writing data to a telnet session.
 * When reading from a telnet session, this function will be called to send data back to the source.
@@ -249,6 +705,34 @@ typedef bool (*telnet_packet_callback_t)(telnet_session_t *session, const telnet
 */
 typedef void (*telnet_writer_t)(telnet_session_t *session, const uint8_t *data, size_t length);
 
+/**
+* Callback function type for sending queued output without blocking.
+* 
+* @param session The current telnet session.
+* @param data The data to send.
+* @param length The length of the data to send.
+* @return The number of bytes that were sent, which may be less than the length or 0 if the destination is busy.
+*/
+typedef size_t (*telnet_output_writer_t)(telnet_session_t *session, const uint8_t *data, size_t length);
+
+/**
+* A segment of data passed to a vector writer.
+*/
+typedef struct {
+  const uint8_t *data;
+  size_t length;
+} telnet_iovec_t;
+
+/**
+* Callback function type for writing several segments of data to a telnet session at once,
+* for example with `writev` or `sendmsg`. The segments are sent in order.
+*
+* @param session The current telnet session.
+* @param segments The segments to send.
+* @param count The number of segments.
+*/
+typedef void (*telnet_vector_writer_t)(telnet_session_t *session, const telnet_iovec_t *segments, size_t count);
+
 /** 
 * Initialize a telnet session. 
 * 
@@ -273,52 +757,407 @@ void *telnet_get_user_data(telnet_session_t *session);
 void telnet_set_user_data(telnet_session_t *session, void *user_data);
 
 /** 
-* Get the the value of an option for a telnet session.
+* Check whether an option is supported on either side of a telnet session.
 * 
 * @param session Pointer to the telnet session structure.
+* @param option The option to check, from 0 to 255.
 * @return True if the option is supported, false otherwise.
 */
 bool telnet_get_option(telnet_session_t *session, telnet_option_t option);
 
 /** 
-* Set the value of an option for a telnet session.
+* Set whether an option is supported on both sides of a telnet session.
+* This is the same as calling `telnet_set_local_option` and `telnet_set_remote_option` with the same value.
+*
+* @param session Pointer to the telnet session structure.
+* @param option The option to change, from 0 to 255.
+* @param value True if the option is supported.
+* @return True if the option was changed, false if the session has no profile of its own and nowhere to copy one.
+*/
+bool telnet_set_option(telnet_session_t *session, telnet_option_t option, bool value);
+
+/**
+* Check whether we are willing to enable an option on our side, meaning we answer DO with WILL.
+*
+* @param session Pointer to the telnet session structure.
+* @param option The option to check, from 0 to 255.
+* @return True if the option is supported locally.
+*/
+bool telnet_get_local_option(const telnet_session_t *session, telnet_option_t option);
+
+/**
+* Set whether we are willing to enable an option on our side, meaning we answer DO with WILL.
+*
+* @param session Pointer to the telnet session structure.
+* @param option The option to change, from 0 to 255.
+* @param value True if the option is supported locally.
+* @return True if the option was changed, false if the session has no profile of its own and nowhere to copy one.
+*/
+bool telnet_set_local_option(telnet_session_t *session, telnet_option_t option, bool value);
+
+/**
+* Check whether we accept an option on the peer's side, meaning we answer WILL with DO.
 *
 * @param session Pointer to the telnet session structure.
-* @param options An array of booleans representing the options to return.
+* @param option The option to check, from 0 to 255.
+* @return True if the option is accepted from the peer.
 */
-void telnet_set_option(telnet_session_t *session, telnet_option_t option, bool value);
+bool telnet_get_remote_option(const telnet_session_t *session, telnet_option_t option);
+
+/**
+* Set whether we accept an option on the peer's side, meaning we answer WILL with DO.
+*
+* @param session Pointer to the telnet session structure.
+* @param option The option to change, from 0 to 255.
+* @param value True if the option is accepted from the peer.
+* @return True if the option was changed, false if the session has no profile of its own and nowhere to copy one.
+*/
+bool telnet_set_remote_option(telnet_session_t *session, telnet_option_t option, bool value);
 
 /**
 * This is a helper method to set all supported options for a telnet session at once.
+* The options are supported on both sides, as with `telnet_set_option`.
+*
+* @param session Pointer to the telnet session structure.
+* @param count The number of options that follow.
+* @return True if the options were changed, false if the session has no profile of its own and nowhere to copy one.
+*/
+bool telnet_supported_options(telnet_session_t *session, telnet_option_t count, ...);
+
+/**
+* Ask the peer to change the state of an option, following the RFC 1143 Q method.
+* Use `TELNET_WILL` or `TELNET_WONT` to enable or disable an option on our side and `TELNET_DO` or `TELNET_DONT`
+* to enable or disable it on the peer's side. Nothing is sent if the option is already in the requested state,
+* and a request made while a negotiation is in progress is remembered and sent once the peer answers.
+* The request goes through the output queue and flush policy. The option only moves to WANTYES or WANTNO once the
+* request has been written or queued, so a request that could not be sent can simply be made again.
+*
+* @param session Pointer to the telnet session structure.
+* @param command `TELNET_WILL`, `TELNET_WONT`, `TELNET_DO` or `TELNET_DONT`.
+* @param option The option to negotiate.
+* @param writer Function used to send the request.
+* @return False if the command or option is invalid, or the request could not be sent (no writer or a full queue).
 */
-void telnet_supported_options(telnet_session_t *session, telnet_option_t option, ...);
+bool telnet_request_option(telnet_session_t *session, telnet_command_t command, telnet_option_t option,
+                           telnet_writer_t writer);
+
+/**
+* Check whether an option is enabled on our side, meaning the peer has agreed to our WILL or we agreed to its DO.
+*
+* @param session Pointer to the telnet session structure.
+* @param option The option to check.
+* @return True if the option is enabled.
+*/
+bool telnet_local_option_enabled(const telnet_session_t *session, telnet_option_t option);
+
+/**
+* Check whether an option is enabled on the peer's side, meaning we agreed to its WILL or it agreed to our DO.
+*
+* @param session Pointer to the telnet session structure.
+* @param option The option to check.
+* @return True if the option is enabled.
+*/
+bool telnet_remote_option_enabled(const telnet_session_t *session, telnet_option_t option);
+
+/**
+* Encode a negotiation script, so sessions can send it with a single write.
+* The requests and the buffer must stay valid for as long as the script is used.
+*
+* @param script The script to initialize.
+* @param requests The options to request, in the order they are sent.
+* @param count Number of requests.
+* @param buffer Storage for the encoded requests, 3 bytes for each one.
+* @param capacity Size of the buffer.
+* @return False if a request is not a WILL or DO, an option is requested twice, or the buffer is too small.
+*/
+bool telnet_script_init(telnet_negotiation_script_t *script, const telnet_negotiation_t *requests, size_t count,
+                        uint8_t *buffer, size_t capacity);
+
+/**
+* Send a negotiation script to the peer, usually right after the connection is accepted.
+* Every request goes out in one write instead of one `telnet_write_packet` call each, and the session then
+* follows through on its own: options marked with `query` get an IAC SB option SEND IAC SE as soon as the peer
+* agrees to them, in the same write as any other replies. Requests for options that are not in the NO state are
+* made one at a time with `telnet_request_option`. The script is remembered by the session, but not checkpointed.
+* Options only move to WANTYES once the script has been written or queued.
+*
+* @param session Pointer to the telnet session structure.
+* @param script A script set up with `telnet_script_init`.
+* @param writer Function used to send the requests.
+* @return False if the script could not be sent (no writer or a full queue), in which case it can be sent again.
+*/
+bool telnet_start_negotiation(telnet_session_t *session, const telnet_negotiation_script_t *script,
+                              telnet_writer_t writer);
 
 /** 
-* Get the subnegotiation options for a telnet session.
+* Get the value sent in reply to a subnegotiation SEND request for an option.
+* 
+* @param session Pointer to the telnet session structure.
+* @param option The option, below `TELNET_MAX_OPTIONS`.
+* @return The null-terminated value, or NULL if the request is not answered automatically.
+*/
+const uint8_t *telnet_get_subnegotiation_option(telnet_session_t *session, telnet_option_t option);
+
+/** 
+* Set the value sent in reply to a subnegotiation SEND request for an option, such as the terminal type.
+* The reply is sent as a subnegotiation IS with the value as its data.
+* 
+* @param session Pointer to the telnet session structure.
+* @param option The option, below `TELNET_MAX_OPTIONS`.
+* @param value A null-terminated string that must stay valid while it is used, or NULL to stop answering.
+* @return True if the value was set, false if the option is out of range or the session has no profile of its own
+*         and nowhere to copy one.
+*/
+bool telnet_set_subnegotiation_option(telnet_session_t *session, telnet_option_t option, const uint8_t *value);
+
+/**
+* Clear a profile, so it supports no options and answers no subnegotiation requests.
+*
+* @param profile The profile to initialize.
+*/
+void telnet_profile_init(telnet_profile_t *profile);
+
+/**
+* Set whether a profile supports an option on both sides, like `telnet_set_option`.
+*
+* @param profile The profile to change.
+* @param option The option, from 0 to 255.
+* @param value True if the option is supported.
+*/
+void telnet_profile_set_option(telnet_profile_t *profile, telnet_option_t option, bool value);
+
+/**
+* Set whether a profile supports an option on our side, like `telnet_set_local_option`.
+*
+* @param profile The profile to change.
+* @param option The option, from 0 to 255.
+* @param value True if the option is supported locally.
+*/
+void telnet_profile_set_local_option(telnet_profile_t *profile, telnet_option_t option, bool value);
+
+/**
+* Set whether a profile accepts an option on the peer's side, like `telnet_set_remote_option`.
+*
+* @param profile The profile to change.
+* @param option The option, from 0 to 255.
+* @param value True if the option is accepted from the peer.
+*/
+void telnet_profile_set_remote_option(telnet_profile_t *profile, telnet_option_t option, bool value);
+
+/**
+* Set the reply to a subnegotiation SEND request in a profile, like `telnet_set_subnegotiation_option`.
+*
+* @param profile The profile to change.
+* @param option The option, below `TELNET_MAX_OPTIONS`.
+* @param value A null-terminated string that must stay valid while it is used, or NULL to stop answering.
+*/
+void telnet_profile_set_subnegotiation_option(telnet_profile_t *profile, telnet_option_t option,
+                                              const uint8_t *value);
+
+/**
+* Make a session use a shared profile instead of its own options.
+* The profile is only read, and must stay valid for as long as the session uses it. The first time an option of
+* the session is changed, the profile is copied into the session's profile storage (see
+* `telnet_set_profile_storage`) or a block from the pool, and the copy is changed instead. If neither is available
+* the change is refused and the function that made it returns false.
+* A block taken from the pool is returned to it when the profile is set again.
+*
+* @param session Pointer to the telnet session structure.
+* @param profile The shared profile, or NULL to go back to an empty profile of the session's own.
+* @param pool Pool to copy the profile into, with blocks of at least `sizeof(telnet_profile_t)` bytes, may be NULL.
+*/
+void telnet_set_profile(telnet_session_t *session, const telnet_profile_t *profile, telnet_pool_t *pool);
+
+/**
+* Give a session storage for a profile of its own, so its options can be changed without sharing a profile.
+* The storage is cleared and becomes the session's profile, as if `telnet_set_profile` had been called with NULL.
+* When a shared profile is set later, the storage is where it is copied to if an option of the session changes.
+* The storage must stay valid for as long as the session uses it.
+*
+* @param session Pointer to the telnet session structure.
+* @param storage The profile storage, or NULL to go back to the profile built into the session, if any
+*                (see `TELNET_SESSION_PROFILE`).
+*/
+void telnet_set_profile_storage(telnet_session_t *session, telnet_profile_t *storage);
+
+/**
+* Initialize an arena using the provided buffer.
+* 
+* @param arena Pointer to the arena to initialize.
+* @param buffer The memory the arena hands out.
+* @param capacity Size of the buffer.
+*/
+void telnet_arena_init(telnet_arena_t *arena, void *buffer, size_t capacity);
+
+/**
+* Allocate storage from an arena.
+* 
+* @param arena Pointer to the arena.
+* @param size Number of bytes to allocate.
+* @return Pointer to the storage, or NULL if the arena does not have enough space left.
+*/
+void *telnet_arena_alloc(telnet_arena_t *arena, size_t size);
+
+/**
+* Release all storage allocated from an arena.
+* 
+* @param arena Pointer to the arena.
+*/
+void telnet_arena_reset(telnet_arena_t *arena);
+
+/**
+* Initialize a pool of fixed size blocks using the provided buffer.
+* The block size is rounded up to a multiple of the pointer size, so the buffer should be sized with `TELNET_POOL_BLOCK_SIZE`.
+* 
+* @param pool Pointer to the pool to initialize.
+* @param buffer The memory the pool hands out.
+* @param block_size Size of each block.
+* @param block_count Number of blocks in the buffer.
+*/
+void telnet_pool_init(telnet_pool_t *pool, void *buffer, size_t block_size, size_t block_count);
+
+/** Size of a pool block after rounding, use this to size pool buffers. */
+#define TELNET_POOL_BLOCK_SIZE(size) (((size) + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *))
+
+/**
+* Take a block from a pool.
+* 
+* @param pool Pointer to the pool.
+* @return Pointer to the block, or NULL if the pool is empty.
+*/
+void *telnet_pool_alloc(telnet_pool_t *pool);
+
+/**
+* Return a block to a pool.
+* 
+* @param pool Pointer to the pool.
+* @param block The block to return.
+*/
+void telnet_pool_free(telnet_pool_t *pool, void *block);
+
+/**
+* Set the buffer that subnegotiation data is collected in.
+* The buffer can come from anywhere, such as `telnet_arena_alloc` or `telnet_pool_alloc`, and must stay valid
+* for as long as the session uses it. Pass NULL to go back to the buffer built into the session.
+* Subnegotiation data that does not fit in the buffer is discarded.
+* 
+* @param session Pointer to the telnet session structure.
+* @param buffer The buffer to use.
+* @param capacity Size of the buffer.
+*/
+void telnet_set_subnegotiation_buffer(telnet_session_t *session, uint8_t *buffer, size_t capacity);
+
+/**
+* Deliver the packets received by each call to `telnet_read` or `telnet_read_into` in a single callback.
+* Packets are collected in the provided array and handed to the callback at the end of the call,
+* or earlier if the array fills up or a new subnegotiation would overwrite the data of a collected one.
+* While batch mode is enabled, the packet callback passed to `telnet_read` is not called and
+* automatic responses are always sent. Pass NULL for `batch` or `packets` to disable batch mode.
+* 
+* @param session Pointer to the telnet session structure.
+* @param batch State for the batch, it must stay valid for as long as batch mode is enabled.
+* @param packets Array to collect packets in, it must stay valid for as long as batch mode is enabled.
+* @param capacity Number of entries in the array.
+* @param callback Function to call with the collected packets.
+*/
+void telnet_set_packet_batch(telnet_session_t *session, telnet_packet_batch_t *batch, telnet_packet_t *packets,
+                             size_t capacity, telnet_packet_batch_callback_t callback);
+
+/**
+* Clear a dispatch table, so no options or commands have handlers.
+*
+* @param dispatch The dispatch table to initialize.
+*/
+void telnet_dispatch_init(telnet_dispatch_t *dispatch);
+
+/**
+* Set the handler for every packet about an option: WILL, WONT, DO, DONT and SB.
+* Option handlers take precedence over command handlers.
+*
+* @param dispatch The dispatch table.
+* @param option The option, from 0 to 255.
+* @param handler Function to call with the packets, or NULL to remove the handler.
+* @return False if the table already holds `TELNET_DISPATCH_HANDLERS` other handlers.
+*/
+bool telnet_dispatch_option(telnet_dispatch_t *dispatch, telnet_option_t option, telnet_packet_callback_t handler);
+
+/**
+* Set the handler for a command, such as `TELNET_AYT` or `TELNET_BRK`.
+* For WILL, WONT, DO, DONT and SB the handler is used for options that do not have their own handler.
+*
+* @param dispatch The dispatch table.
+* @param command A command from `TELNET_EOR` to `TELNET_DONT`.
+* @param handler Function to call with the packets, or NULL to remove the handler.
+* @return False if the command is out of range or the table already holds `TELNET_DISPATCH_HANDLERS` other handlers.
+*/
+bool telnet_dispatch_command(telnet_dispatch_t *dispatch, telnet_command_t command, telnet_packet_callback_t handler);
+
+/**
+* Use a dispatch table for the packets received by a session.
+* Packets with a handler in the table go straight to it instead of the packet callback, packet batch or event list,
+* and the handler's return value decides whether the automatic response is sent, as with the packet callback.
+* Packets without a handler are delivered as before. The table is not used by `telnet_read_events`, which returns
+* every packet as an event, and subnegotiations streamed with `telnet_stream_subnegotiations` still end with the
+* stream's end callback.
+*
+* @param session Pointer to the telnet session structure.
+* @param dispatch The dispatch table, which must stay valid while it is in use, or NULL to stop using one.
+*/
+void telnet_set_dispatch(telnet_session_t *session, const telnet_dispatch_t *dispatch);
+
+/**
+* Set how newlines in received data are translated.
+* With `TELNET_NEWLINE_NVT`, `telnet_read` and `telnet_read_into` turn CR LF into LF and CR NUL into CR
+* while removing telnet commands. A CR at the end of a buffer is held back until the next buffer shows what follows it.
+* A bare CR, followed by anything else, is passed on as it is. `telnet_read` works in place, so when that CR came at the
+* end of the previous buffer it is put in front of the new data, which can make the data one byte longer than the
+* buffer that was read: with NVT newlines, the buffer passed to `telnet_read` must have room for one spare byte.
+* Translation is turned off while the peer is sending in BINARY mode.
+* Data spans returned by `telnet_read_events` are never translated.
+* 
+* @param session Pointer to the telnet session structure.
+* @param mode The newline mode, `TELNET_NEWLINE_NONE` by default.
+*/
+void telnet_set_input_newlines(telnet_session_t *session, telnet_newline_t mode);
+
+/**
+* Set how newlines in sent data are translated.
+* With `TELNET_NEWLINE_NVT`, `telnet_write`, `telnet_writev` and `telnet_write_length` send a bare LF as CR LF
+* and a bare CR as CR NUL, while CR LF is sent as it is. Each write is translated on its own, so a CR at the end of
+* one write is bare even if the next write starts with LF; keep CR LF in the same write.
+* Translation is turned off while we are sending in BINARY mode. Subnegotiation data is never translated.
 * 
 * @param session Pointer to the telnet session structure.
-* @return A pointer to an array of strings representing the subnegotiation options.
+* @param mode The newline mode, `TELNET_NEWLINE_NONE` by default.
 */
-const uint8_t **telnet_get_subnegotiation_options(telnet_session_t *session);
+void telnet_set_output_newlines(telnet_session_t *session, telnet_newline_t mode);
 
 /** 
-* Set the subnegotiation options for a telnet session.
-* These options are used when the response mode is set to automatic.
-* **Note:** The options should be null-terminated strings.
-* **Note:** The array must be of length 50.
+* Stream subnegotiations for a telnet session instead of collecting them in the packet.
+* When streaming is enabled, `begin` is called once the option and type of a subnegotiation are known, `data` is called
+* with the payload as it arrives and `end` is called when the subnegotiation is complete.
+* The packet passed to `end` has no subnegotiation data, and its return value controls automatic responses
+* in the same way as the packet callback. The packet callback is not called for streamed subnegotiations.
+* This allows subnegotiations of any size without copying them into the session.
+* Pass NULL, or callbacks without a `data` function, to disable streaming.
 * 
 * @param session Pointer to the telnet session structure.
-* @param options An array of strings representing the subnegotiation options to return.
+* @param stream The callbacks, which must stay valid for as long as the session uses them.
 */
-void telnet_set_subnegotiation_options(telnet_session_t *session, const uint8_t **options);
+void telnet_stream_subnegotiations(telnet_session_t *session, const telnet_subnegotiation_stream_t *stream);
 
 /** 
 * Read data from a telnet session.
 * This function processes the incoming data and calls the provided callback when a complete packet is received.
 * When packet data is received, it will remove that data from the buffer by modifying the buffer in place.
+* Automatic replies are collected while reading and passed to the writer together before this function returns.
+* A subnegotiation cut short by IAC and a command other than SE is delivered with the data received so far,
+* and the command is then parsed as the next packet.
+* With NVT input newlines (see `telnet_set_input_newlines`), a bare CR held back from the end of the previous buffer
+* is put in front of the data, so the buffer must have room for `length + 1` bytes and the result can be `length + 1`.
 * 
 * @param session Pointer to the telnet session structure.
-* @param data Pointer to the data to read.
+* @param data Pointer to the data to read, with room for one more byte when NVT input newlines are used.
 * @param length Length of the data to read.
 * @param callback Function to call when a complete packet is received.
 * @param writer Function for sending automatic replies back to the source.
@@ -326,17 +1165,225 @@ void telnet_set_subnegotiation_options(telnet_session_t *session, const uint8_t
 */
 size_t telnet_read(telnet_session_t *session, uint8_t *data, size_t length, telnet_packet_callback_t callback,  telnet_writer_t writer);
 
+/** 
+* Read data from a telnet session into a separate output buffer.
+* This works like `telnet_read`, but the input buffer is never modified, so it can be used with read-only memory
+* such as memory mapped files or buffers owned by the network stack.
+* If the output buffer fills up, parsing stops before the next byte of data and `consumed` is set to the number
+* of input bytes that were processed. Call the function again with the remaining input to continue.
+* 
+* @param session Pointer to the telnet session structure.
+* @param data Pointer to the data to read.
+* @param length Length of the data to read.
+* @param output Pointer to the buffer that receives the data with telnet commands removed. It must not overlap `data`.
+* @param capacity Size of the output buffer.
+* @param consumed Set to the number of bytes of `data` that were processed.
+* @param callback Function to call when a complete packet is received.
+* @param writer Function for sending automatic replies back to the source.
+* @return The number of bytes written to the output buffer.
+*/
+size_t telnet_read_into(telnet_session_t *session, const uint8_t *data, size_t length, uint8_t *output, size_t capacity,
+                        size_t *consumed, telnet_packet_callback_t callback, telnet_writer_t writer);
+
+/** 
+* Read data from a telnet session as a list of events.
+* Instead of copying data, this function describes the input as an ordered list of data spans and commands.
+* The input buffer is never modified and no data is copied, so data spans can be handed directly to functions like `writev`.
+* Automatic replies are sent for commands as they are parsed.
+* If the event array fills up, parsing stops and `consumed` is set to the number of input bytes that were processed.
+* Call the function again with the remaining input to continue.
+* 
+* @param session Pointer to the telnet session structure.
+* @param data Pointer to the data to read.
+* @param length Length of the data to read.
+* @param events Array that receives the events.
+* @param max_events Number of entries in the events array.
+* @param consumed Set to the number of bytes of `data` that were processed.
+* @param writer Function for sending automatic replies back to the source.
+* @return The number of events written to the events array.
+*/
+size_t telnet_read_events(telnet_session_t *session, const uint8_t *data, size_t length, telnet_event_t *events, size_t max_events,
+                          size_t *consumed, telnet_writer_t writer);
+
 /**
  * Write data to a telnet session.
  * This function sends the provided data to the destination using the specified writer function.
  * It escapes data as necessary to conform to the telnet protocol.
+ * The escaped data is collected in the session's output buffer (see `telnet_set_output_buffer`),
+ * so the writer is called once unless the escaped data does not fit in the buffer.
+ * With a flush policy (see `telnet_set_flush_policy`), the data may be held in the buffer and sent later.
+ * If the session has an output queue (see `telnet_set_output_queue`), the data is added to the queue instead
+ * and the writer is not used.
  * 
  * @param session Pointer to the telnet session structure.
  * @param data Pointer to the data to write.
  * @param length Length of the data to write.
  * @param writer Function for sending data to the destination.
+ * @return The number of bytes of data written. This is less than the length if the output queue is full.
+ */
+size_t telnet_write(telnet_session_t *session, const uint8_t *data, size_t length, telnet_writer_t writer);
+
+/**
+ * Give the session a queue for its output, using storage provided by the application.
+ * `telnet_write`, `telnet_write_packet` and automatic responses then add to the queue instead of calling a writer,
+ * and `telnet_flush_output` sends the queue when the destination is ready.
+ * When the queue fills up to the high watermark the callback receives `TELNET_OUTPUT_HIGH_WATERMARK`, and once it
+ * drains down to the low watermark it receives `TELNET_OUTPUT_LOW_WATERMARK`. Output that does not fit is refused,
+ * and the callback receives `TELNET_OUTPUT_OVERFLOW`. Packets are never partly queued.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param queue State for the queue, or NULL to remove the queue. It must stay valid while the session uses it.
+ * @param storage The storage for the queue, or NULL to remove the queue. It must stay valid while the session uses it.
+ * @param capacity Size of the storage, at least 2 bytes.
+ * @param low_watermark Number of queued bytes at or below which the queue is considered drained.
+ * @param high_watermark Number of queued bytes at or above which the queue is considered full.
+ * @param callback Function to notify about the queue, can be NULL.
+ */
+void telnet_set_output_queue(telnet_session_t *session, telnet_output_queue_t *queue, uint8_t *storage,
+                             size_t capacity, size_t low_watermark, size_t high_watermark,
+                             telnet_output_callback_t callback);
+
+/**
+ * Get the number of bytes waiting in the session's output queue.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @return The number of queued bytes.
+ */
+size_t telnet_output_queued(const telnet_session_t *session);
+
+/**
+ * Send as much of the output queue as the writer will take, without waiting.
+ * The writer is called until the queue is empty or it accepts less than it was given.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param writer Function for sending data to the destination.
+ * @return The number of bytes still queued.
+ */
+size_t telnet_flush_output(telnet_session_t *session, telnet_output_writer_t writer);
+
+/**
+ * Get the length of data once it has been escaped for sending.
+ * 
+ * @param data Data to be escaped.
+ * @param length Length of the data.
+ * @return The number of bytes `telnet_escape` will produce for the data.
+ */
+size_t telnet_escaped_length(const uint8_t *data, size_t length);
+
+/**
+ * Escape data for sending without a session or writer, for example to fill a transmit buffer directly.
+ * 
+ * @param data Data to escape.
+ * @param length Length of the data.
+ * @param output Buffer for the escaped data. It must not overlap the data.
+ * @param capacity Size of the output buffer.
+ * @return The number of bytes written to the output buffer, or 0 if it is smaller than `telnet_escaped_length`.
  */
-void telnet_write(telnet_session_t *session, const uint8_t *data, size_t length, telnet_writer_t writer);
+size_t telnet_escape(const uint8_t *data, size_t length, uint8_t *output, size_t capacity);
+
+/**
+ * Escape as much data as fits in a fixed size buffer, such as a socket send buffer or DMA descriptor.
+ * An escaped IAC is never split across two buffers, so escaping can be resumed with the
+ * remaining data once the buffer has been sent. With a buffer of at least 2 bytes, every call with data
+ * escapes at least one byte of it. Smaller buffers are refused, as they cannot hold an escaped IAC.
+ * 
+ * @param data Data to escape.
+ * @param length Length of the data.
+ * @param output Buffer for the escaped data. It must not overlap the data.
+ * @param capacity Size of the output buffer, at least 2 bytes.
+ * @param consumed Set to the number of bytes of data that were escaped. Can be NULL.
+ * @return The number of bytes written to the output buffer, or 0 if the buffer is smaller than 2 bytes.
+ */
+size_t telnet_write_to_buffer(const uint8_t *data, size_t length, uint8_t *output, size_t capacity, size_t *consumed);
+
+/**
+ * Write the same data to many telnet sessions.
+ * The data is escaped once into the buffer for each output mode in use, and the encoded copy is passed to the writer
+ * (or output queue) of every session that uses that mode. Each session gets its copy in a single write.
+ * A session whose output queue has no room for the whole message gets none of it.
+ * If the buffer is too small to hold an encoded copy, those sessions fall back to `telnet_write`.
+ * 
+ * @param sessions The sessions to write to. NULL entries are skipped.
+ * @param count The number of sessions.
+ * @param data Data to write.
+ * @param length Length of the data.
+ * @param buffer Buffer for the encoded copies. Four times the length of the data is always enough.
+ * @param capacity Size of the buffer.
+ * @param writer Function for sending data to the destination.
+ * @return The number of sessions the whole message was written to.
+ */
+size_t telnet_broadcast(telnet_session_t *const *sessions, size_t count, const uint8_t *data, size_t length,
+                        uint8_t *buffer, size_t capacity, telnet_writer_t writer);
+
+/**
+ * Get the number of bytes `telnet_write` will send for some data, including escaping and newline translation.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param data Data to be written.
+ * @param length Length of the data.
+ * @return The number of bytes that will be sent.
+ */
+size_t telnet_write_length(const telnet_session_t *session, const uint8_t *data, size_t length);
+
+/**
+ * Write data to a telnet session using a vector writer.
+ * The escaped data is passed to the writer as segments of the original data, without being copied.
+ * Each IAC byte ends one segment and starts the next one, so it is sent twice. Segments are never empty.
+ * The writer is called once for every `TELNET_WRITEV_SEGMENTS` segments, and output or replies the session is
+ * still holding are sent in the first segments, ahead of the data.
+ * Like `telnet_write`, the data is added to the output queue instead if the session has one (see
+ * `telnet_set_output_queue`), and with a flush policy a write the policy would hold back is copied into the
+ * output buffer and sent later (see `telnet_set_flush_policy`).
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param data Data to write.
+ * @param length Length of the data to write.
+ * @param writer Function for sending segments to the destination.
+ * @return The number of bytes of data written. This is less than the length if the output queue is full.
+ */
+size_t telnet_writev(telnet_session_t *session, const uint8_t *data, size_t length, telnet_vector_writer_t writer);
+
+/**
+ * Send any output the session is holding back, such as automatic replies and output held by the flush policy.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param writer Function for sending data to the destination.
+ */
+void telnet_flush(telnet_session_t *session, telnet_writer_t writer);
+
+/**
+ * Set when output is held back to be sent together (see `telnet_flush_policy_t`).
+ * The session needs an output buffer to hold output in. Without a policy, which is the default,
+ * each call to `telnet_write` is passed to the writer straight away.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param policy The policy to use, or NULL to send output straight away. It must stay valid while the session uses it.
+ */
+void telnet_set_flush_policy(telnet_session_t *session, const telnet_flush_policy_t *policy);
+
+/**
+ * Tell the session the current time, and send held output whose deadline has passed.
+ * Call this regularly from your main loop when using a flush policy with a `max_delay`.
+ * Any clock will do, such as `millis()`, as long as `max_delay` uses the same units. The clock may wrap around.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param now The current time.
+ * @param writer Function for sending data to the destination.
+ */
+void telnet_poll(telnet_session_t *session, uint32_t now, telnet_writer_t writer);
+
+/**
+ * Set the buffer `telnet_write` escapes data into before passing it to the writer.
+ * Each call to `telnet_write` calls the writer once if the escaped data fits in the buffer.
+ * Without an output buffer, a buffer of `TELNET_WRITE_BUFFER_SIZE` bytes on the stack is used.
+ * The buffer cannot be changed while a flush policy is holding output in it; call `telnet_flush` first.
+ * 
+ * @param session Pointer to the telnet session structure.
+ * @param buffer The buffer to use, or NULL to go back to the stack buffer. It must stay valid while the session uses it.
+ * @param capacity Size of the buffer, at least 2 bytes.
+ * @return False if the session is still holding output, in which case the buffer is not changed.
+ */
+bool telnet_set_output_buffer(telnet_session_t *session, uint8_t *buffer, size_t capacity);
 
 /**
  * Initialize a telnet packet.
@@ -350,6 +1397,7 @@ void telnet_init_packet(telnet_packet_t *packet);
  * Write a telnet packet to a telnet session.
  * This function sends the provided packet to the destination using the specified writer function.
  * It escapes data as necessary to conform to the telnet protocol.
+ * If the session has an output queue, the packet is added to the queue instead and the writer is not used.
  * 
  * @param session Pointer to the telnet session structure.
  * @param packet Pointer to the telnet packet to write.
@@ -357,6 +1405,35 @@ void telnet_init_packet(telnet_packet_t *packet);
  */
 void telnet_write_packet(telnet_session_t *session, const telnet_packet_t *packet, telnet_writer_t writer);
 
+/**
+* Save the state of a telnet session so it can be restored in another process.
+* The checkpoint holds the parser state, any partially received packet, the supported options, negotiated state,
+* newline translation and subnegotiation options. It does not hold anything that is only meaningful in this
+* process: the user data, callbacks, packet batch and buffers given to the session must be set up again before restoring.
+* 
+* @param session Pointer to the telnet session structure.
+* @param buffer Buffer to write the checkpoint to, or NULL to find out how big the checkpoint is.
+* @param capacity Size of the buffer.
+* @return The size of the checkpoint, or 0 if it does not fit in the buffer.
+*/
+size_t telnet_checkpoint(telnet_session_t *session, uint8_t *buffer, size_t capacity);
+
+/**
+* Restore the state of a telnet session from a checkpoint made by `telnet_checkpoint`.
+* The session should be initialized and have its callbacks and buffers set up before restoring.
+* If the session's profile already holds the options in the checkpoint, as it does when the same shared profile is
+* set with `telnet_set_profile` first, the profile is kept. Otherwise the options are copied into a profile of the
+* session's own and the subnegotiation options into the arena, which must stay valid for as long as the session
+* uses them.
+* 
+* @param session Pointer to the telnet session structure.
+* @param data The checkpoint.
+* @param length Size of the checkpoint.
+* @param arena Arena to store subnegotiation options in, may be NULL if none are set or the profile matches.
+* @return True if the session was restored, false if the checkpoint is not valid or the options do not fit.
+*/
+bool telnet_restore(telnet_session_t *session, const uint8_t *data, size_t length, telnet_arena_t *arena);
+
 /** Returns a human readable name for a given telnet option */
 const char *telnet_option_name(uint8_t option);
 
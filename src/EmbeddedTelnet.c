@@ -22,9 +22,27 @@ SOFTWARE.
 
 #include <EmbeddedTelnet.h>
 
-#define _bit_set(bits, index) ((bits) |= (1ULL << (index)))
-#define _bit_clear(bits, index) ((bits) &= ~(1ULL << (index)))
-#define _bit_get(bits, index) (((bits) & (1ULL << (index))) != 0)
+// Vector kernels are only built for x86 with GCC or Clang, define TELNET_NO_SIMD to disable them.
+#if !defined(TELNET_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define TELNET_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Option sets are arrays of 32 bit words, indexed with the low 8 bits of the option so any value stays in bounds
+#define _bit_word(index) (((uint32_t)(index) & 0xFF) >> 5)
+#define _bit_mask(index) ((uint32_t)1 << ((uint32_t)(index) & 31))
+#define _bit_set(bits, index) ((bits)[_bit_word(index)] |= _bit_mask(index))
+#define _bit_clear(bits, index) ((bits)[_bit_word(index)] &= ~_bit_mask(index))
+#define _bit_get(bits, index) ((((bits)[_bit_word(index)] >> ((uint32_t)(index) & 31)) & 1) != 0)
+#define _bit_assign(bits, index, value) \
+  ((bits)[_bit_word(index)] = ((bits)[_bit_word(index)] & ~_bit_mask(index)) | \
+                              ((uint32_t)(value) << ((uint32_t)(index) & 31)))
+
+// Session flags
+#define _FLAG_PENDING_CR    0x04 /* The last data byte read was a CR */
+
+// Flags that describe the protocol state rather than the session's buffers
+#define _PROTOCOL_FLAGS _FLAG_PENDING_CR
 
 void telnet_init_packet(telnet_packet_t *packet) {
   if (packet == NULL) {
@@ -35,42 +53,75 @@ void telnet_init_packet(telnet_packet_t *packet) {
   packet->option = TELNET_OPTION_BINARY; // Default option
   packet->subnegotiation_type = TELNET_SE_IS; // Default subnegotiation type
   packet->subnegotiation_length = 0; // No data initially
-  memset(packet->subnegotiation_data, 0, sizeof(packet->subnegotiation_data)); // Clear data
+  packet->subnegotiation_data = NULL; // No data initially
 }
 
-void telnet_write_packet(telnet_session_t *session, const telnet_packet_t *packet, telnet_writer_t writer) {
-  if (session == NULL || packet == NULL || writer == NULL) {
+// Allocations from an arena are aligned for any pointer or integer member
+#define _ARENA_ALIGNMENT (sizeof(void *) > sizeof(uint64_t) ? sizeof(void *) : sizeof(uint64_t))
+
+void telnet_arena_init(telnet_arena_t *arena, void *buffer, size_t capacity) {
+  if (arena == NULL) {
     return;
   }
-  
-  uint8_t buffer[80];
-  size_t length = 0;
-  
-  // Start with IAC (Interpret As Command)
-  buffer[length++] = TELNET_IAC;
-  buffer[length++] = packet->command;
-  switch(packet->command) {
-    case TELNET_DO:
-    case TELNET_DONT:
-    case TELNET_WILL:
-    case TELNET_WONT:
-    buffer[length++] = packet->option;
-    break;
-    case TELNET_SB:
-    buffer[length++] = packet->option; // Option for subnegotiation
-    buffer[length++] = packet->subnegotiation_type; // Subnegotiation type
-    memcpy(&buffer[length], packet->subnegotiation_data, packet->subnegotiation_length);
-    length += packet->subnegotiation_length;
-    buffer[length++] = TELNET_IAC; // End of subnegotiation
-    buffer[length++] = TELNET_SE; // Subnegotiation end
-    break;
-    default:
-    // For other commands, we just send the command byte
-    break;
+  arena->buffer = (uint8_t *)buffer;
+  arena->capacity = (buffer != NULL) ? capacity : 0;
+  arena->used = 0;
+}
+
+void *telnet_arena_alloc(telnet_arena_t *arena, size_t size) {
+  if (arena == NULL || arena->buffer == NULL) {
+    return NULL;
   }
-  
-  // Call the writer to send the packet
-  writer(session, buffer, length);
+  size_t padding = (_ARENA_ALIGNMENT - ((uintptr_t)(arena->buffer + arena->used) % _ARENA_ALIGNMENT)) % _ARENA_ALIGNMENT;
+  if (padding > arena->capacity - arena->used || size > arena->capacity - arena->used - padding) {
+    return NULL;
+  }
+  void *block = arena->buffer + arena->used + padding;
+  arena->used += padding + size;
+  return block;
+}
+
+void telnet_arena_reset(telnet_arena_t *arena) {
+  if (arena == NULL) {
+    return;
+  }
+  arena->used = 0;
+}
+
+void telnet_pool_init(telnet_pool_t *pool, void *buffer, size_t block_size, size_t block_count) {
+  if (pool == NULL) {
+    return;
+  }
+  // Free blocks hold a pointer to the next free block, so blocks must be big enough and aligned for one
+  block_size = (block_size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+  pool->block_size = block_size;
+  pool->free_list = NULL;
+  if (buffer == NULL || block_size == 0) {
+    return;
+  }
+  uint8_t *blocks = (uint8_t *)buffer;
+  for (size_t i = block_count; i > 0; i--) {
+    void *block = blocks + (i - 1) * block_size;
+    memcpy(block, &pool->free_list, sizeof(void *));
+    pool->free_list = block;
+  }
+}
+
+void *telnet_pool_alloc(telnet_pool_t *pool) {
+  if (pool == NULL || pool->free_list == NULL) {
+    return NULL;
+  }
+  void *block = pool->free_list;
+  memcpy(&pool->free_list, block, sizeof(void *));
+  return block;
+}
+
+void telnet_pool_free(telnet_pool_t *pool, void *block) {
+  if (pool == NULL || block == NULL) {
+    return;
+  }
+  memcpy(block, &pool->free_list, sizeof(void *));
+  pool->free_list = block;
 }
 
 void telnet_init(telnet_session_t *session) {
@@ -80,8 +131,33 @@ void telnet_init(telnet_session_t *session) {
   
   session->state = TELNET_STATE_READY;
   telnet_init_packet(&session->packet);
-  session->options = 0;
-  memset(session->subnegotiation_options, 0, sizeof(session->subnegotiation_options));
+  session->profile_copy = NULL;
+  session->profile_pool = NULL;
+#if TELNET_SESSION_PROFILE
+  session->profile_storage = &session->profile_builtin;
+#else
+  session->profile_storage = NULL;
+#endif
+  telnet_set_profile(session, NULL, NULL);
+  memset(&session->local_options, 0, sizeof(session->local_options));
+  memset(&session->remote_options, 0, sizeof(session->remote_options));
+  session->negotiation_script = NULL;
+  session->subnegotiation_stream = NULL;
+  session->subnegotiation_buffer = NULL;
+  session->subnegotiation_capacity = 0;
+  session->packet_batch = NULL;
+  session->dispatch = NULL;
+  session->input_newlines = TELNET_NEWLINE_NONE;
+  session->output_newlines = TELNET_NEWLINE_NONE;
+  session->flags = 0;
+  session->output_buffer = NULL;
+  session->output_capacity = 0;
+  session->output_length = 0;
+  session->reply_length = 0;
+  session->flush_policy = NULL;
+  session->output_clock = 0;
+  session->output_deadline = 0;
+  session->output_queue = NULL;
   session->user_data = NULL;
 }
 
@@ -99,51 +175,393 @@ void telnet_set_user_data(telnet_session_t *session, void *user_data) {
   session->user_data = user_data;
 }
 
+// The profile of sessions that have no profile of their own
+static const telnet_profile_t _empty_profile;
+
+void telnet_profile_init(telnet_profile_t *profile) {
+  if (profile == NULL) {
+    return;
+  }
+  memset(profile, 0, sizeof(*profile));
+}
+
+void telnet_profile_set_option(telnet_profile_t *profile, telnet_option_t option, bool value) {
+  telnet_profile_set_local_option(profile, option, value);
+  telnet_profile_set_remote_option(profile, option, value);
+}
+
+void telnet_profile_set_local_option(telnet_profile_t *profile, telnet_option_t option, bool value) {
+  if (profile == NULL) {
+    return;
+  }
+  _bit_assign(profile->local_supported, option, value);
+}
+
+void telnet_profile_set_remote_option(telnet_profile_t *profile, telnet_option_t option, bool value) {
+  if (profile == NULL) {
+    return;
+  }
+  _bit_assign(profile->remote_supported, option, value);
+}
+
+void telnet_profile_set_subnegotiation_option(telnet_profile_t *profile, telnet_option_t option,
+                                              const uint8_t *value) {
+  if (profile == NULL || option < 0 || option >= TELNET_MAX_OPTIONS) {
+    return;
+  }
+  profile->subnegotiation_options[option] = value;
+}
+
+// Returns true if the session's copy of its profile is a block taken from its pool
+static bool _profile_from_pool(const telnet_session_t *session) {
+  return session->profile_pool != NULL && session->profile_copy != NULL &&
+         session->profile_copy != session->profile_storage;
+}
+
+void telnet_set_profile(telnet_session_t *session, const telnet_profile_t *profile, telnet_pool_t *pool) {
+  if (session == NULL) {
+    return;
+  }
+  if (_profile_from_pool(session)) {
+    telnet_pool_free(session->profile_pool, session->profile_copy);
+  }
+  session->profile_copy = session->profile_storage;
+  session->profile_pool = (pool != NULL && pool->block_size >= sizeof(telnet_profile_t)) ? pool : NULL;
+  if (profile == NULL && session->profile_storage != NULL) {
+    telnet_profile_init(session->profile_storage);
+    profile = session->profile_storage;
+  }
+  session->profile = (profile != NULL) ? profile : &_empty_profile;
+}
+
+void telnet_set_profile_storage(telnet_session_t *session, telnet_profile_t *storage) {
+  if (session == NULL) {
+    return;
+  }
+  if (_profile_from_pool(session)) {
+    telnet_pool_free(session->profile_pool, session->profile_copy);
+  }
+  session->profile_copy = NULL;
+#if TELNET_SESSION_PROFILE
+  session->profile_storage = (storage != NULL) ? storage : &session->profile_builtin;
+#else
+  session->profile_storage = storage;
+#endif
+  telnet_set_profile(session, NULL, NULL);
+}
+
+// Get a profile the session may change, copying a shared profile first.
+// Returns NULL if the session has nowhere to put a copy.
+static telnet_profile_t *_writable_profile(telnet_session_t *session) {
+  if (session == NULL) {
+    return NULL;
+  }
+  if (session->profile_copy == NULL && session->profile_pool != NULL) {
+    session->profile_copy = (telnet_profile_t *)telnet_pool_alloc(session->profile_pool);
+  }
+  if (session->profile_copy == NULL) {
+    return NULL;
+  }
+  if (session->profile != session->profile_copy) {
+    *session->profile_copy = *session->profile;
+    session->profile = session->profile_copy;
+  }
+  return session->profile_copy;
+}
+
 bool telnet_get_option(telnet_session_t *session, telnet_option_t option) {
   if (session == NULL) {
     return false;
   }
-  return _bit_get(session->options, option);
+  return _bit_get(session->profile->local_supported, option) || _bit_get(session->profile->remote_supported, option);
+}
+
+bool telnet_set_option(telnet_session_t *session, telnet_option_t option, bool value) {
+  telnet_profile_t *profile = _writable_profile(session);
+  if (profile == NULL) {
+    return false;
+  }
+  telnet_profile_set_option(profile, option, value);
+  return true;
 }
 
-void telnet_set_option(telnet_session_t *session, telnet_option_t option, bool value) {
+bool telnet_get_local_option(const telnet_session_t *session, telnet_option_t option) {
   if (session == NULL) {
-    return;
+    return false;
   }
-  if (value) {
-    _bit_set(session->options, option);
-  } else {
-    _bit_clear(session->options, option);
+  return _bit_get(session->profile->local_supported, option);
+}
+
+bool telnet_set_local_option(telnet_session_t *session, telnet_option_t option, bool value) {
+  telnet_profile_t *profile = _writable_profile(session);
+  if (profile == NULL) {
+    return false;
   }
+  telnet_profile_set_local_option(profile, option, value);
+  return true;
 }
 
-void telnet_supported_options(telnet_session_t *session, telnet_option_t option, ...) {
+bool telnet_get_remote_option(const telnet_session_t *session, telnet_option_t option) {
   if (session == NULL) {
-    return;
+    return false;
+  }
+  return _bit_get(session->profile->remote_supported, option);
+}
+
+bool telnet_set_remote_option(telnet_session_t *session, telnet_option_t option, bool value) {
+  telnet_profile_t *profile = _writable_profile(session);
+  if (profile == NULL) {
+    return false;
+  }
+  telnet_profile_set_remote_option(profile, option, value);
+  return true;
+}
+
+bool telnet_supported_options(telnet_session_t *session, telnet_option_t option, ...) {
+  telnet_profile_t *profile = _writable_profile(session);
+  if (profile == NULL) {
+    return false;
   }
   
   va_list args;
   va_start(args, option);
   
   for (int i = 0; i < option; i++) {
-    _bit_set(session->options, va_arg(args, telnet_option_t));
+    telnet_profile_set_option(profile, va_arg(args, telnet_option_t), true);
   }
   
   va_end(args);
+  return true;
 }
 
 const uint8_t *telnet_get_subnegotiation_option(telnet_session_t *session, telnet_option_t option) {
-  if (session == NULL) {
+  if (session == NULL || option < 0 || option >= TELNET_MAX_OPTIONS) {
     return NULL;
   }
-  return session->subnegotiation_options[option];
+  return session->profile->subnegotiation_options[option];
+}
+
+bool telnet_set_subnegotiation_option(telnet_session_t *session, telnet_option_t option, const uint8_t *value) {
+  if (option < 0 || option >= TELNET_MAX_OPTIONS) {
+    return false;
+  }
+  telnet_profile_t *profile = _writable_profile(session);
+  if (profile == NULL) {
+    return false;
+  }
+  telnet_profile_set_subnegotiation_option(profile, option, value);
+  return true;
+}
+
+void telnet_stream_subnegotiations(telnet_session_t *session, const telnet_subnegotiation_stream_t *stream) {
+  if (session == NULL) {
+    return;
+  }
+  // Without a data callback there is nothing to stream to, so subnegotiations are collected as usual
+  session->subnegotiation_stream = (stream != NULL && stream->data != NULL) ? stream : NULL;
+}
+
+void telnet_set_subnegotiation_buffer(telnet_session_t *session, uint8_t *buffer, size_t capacity) {
+  if (session == NULL) {
+    return;
+  }
+  session->subnegotiation_buffer = buffer;
+  session->subnegotiation_capacity = (buffer != NULL) ? capacity : 0;
+  session->packet.subnegotiation_length = 0;
+}
+
+void telnet_set_packet_batch(telnet_session_t *session, telnet_packet_batch_t *batch, telnet_packet_t *packets,
+                             size_t capacity, telnet_packet_batch_callback_t callback) {
+  if (session == NULL) {
+    return;
+  }
+  if (batch == NULL || packets == NULL || capacity == 0 || callback == NULL) {
+    session->packet_batch = NULL;
+    return;
+  }
+  batch->packets = packets;
+  batch->capacity = capacity;
+  batch->count = 0;
+  batch->has_subnegotiation = false;
+  batch->callback = callback;
+  session->packet_batch = batch;
+}
+
+void telnet_dispatch_init(telnet_dispatch_t *dispatch) {
+  if (dispatch == NULL) {
+    return;
+  }
+  memset(dispatch, 0, sizeof(*dispatch));
+}
+
+// Returns true if any option or command uses a slot
+static bool _dispatch_slot_used(const telnet_dispatch_t *dispatch, uint8_t slot) {
+  return memchr(dispatch->option_slots, slot, sizeof(dispatch->option_slots)) != NULL ||
+         memchr(dispatch->command_slots, slot, sizeof(dispatch->command_slots)) != NULL;
+}
+
+// Find the slot of a handler, adding the handler to the table if it is not there yet.
+// Slot 0 always holds NULL. Returns false if the table is full.
+static bool _dispatch_slot(telnet_dispatch_t *dispatch, telnet_packet_callback_t handler, uint8_t *slot) {
+  if (handler == NULL) {
+    *slot = 0;
+    return true;
+  }
+  for (size_t i = 1; i <= dispatch->count; i++) {
+    if (dispatch->handlers[i] == handler) {
+      *slot = (uint8_t)i;
+      return true;
+    }
+  }
+  if (dispatch->count < TELNET_DISPATCH_HANDLERS) {
+    dispatch->count++;
+    *slot = (uint8_t)dispatch->count;
+    dispatch->handlers[*slot] = handler;
+    return true;
+  }
+  // Reuse the slot of a handler that has since been removed
+  for (size_t i = 1; i <= dispatch->count; i++) {
+    if (!_dispatch_slot_used(dispatch, (uint8_t)i)) {
+      *slot = (uint8_t)i;
+      dispatch->handlers[i] = handler;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool telnet_dispatch_option(telnet_dispatch_t *dispatch, telnet_option_t option, telnet_packet_callback_t handler) {
+  uint8_t slot;
+  if (dispatch == NULL || option < 0 || option > 255 || !_dispatch_slot(dispatch, handler, &slot)) {
+    return false;
+  }
+  dispatch->option_slots[option] = slot;
+  return true;
+}
+
+bool telnet_dispatch_command(telnet_dispatch_t *dispatch, telnet_command_t command, telnet_packet_callback_t handler) {
+  uint8_t slot;
+  if (dispatch == NULL || command < TELNET_EOR || command > TELNET_DONT || !_dispatch_slot(dispatch, handler, &slot)) {
+    return false;
+  }
+  dispatch->command_slots[command - TELNET_EOR] = slot;
+  return true;
+}
+
+void telnet_set_dispatch(telnet_session_t *session, const telnet_dispatch_t *dispatch) {
+  if (session == NULL) {
+    return;
+  }
+  session->dispatch = dispatch;
+}
+
+void telnet_set_input_newlines(telnet_session_t *session, telnet_newline_t mode) {
+  if (session == NULL) {
+    return;
+  }
+  session->input_newlines = mode;
 }
 
-void telnet_set_subnegotiation_option(telnet_session_t *session, telnet_option_t option, uint8_t *value) {
+void telnet_set_output_newlines(telnet_session_t *session, telnet_newline_t mode) {
   if (session == NULL) {
     return;
   }
-  session->subnegotiation_options[option] = value;
+  session->output_newlines = mode;
+}
+
+// Returns the buffer subnegotiation data is collected in and its size
+static uint8_t *_subnegotiation_buffer(telnet_session_t *session, size_t *capacity) {
+  if (session->subnegotiation_buffer != NULL) {
+    *capacity = session->subnegotiation_capacity;
+    return session->subnegotiation_buffer;
+  }
+#if TELNET_SUBNEGOTIATION_BUFFER_SIZE > 0
+  *capacity = sizeof(session->subnegotiation_storage);
+  return session->subnegotiation_storage;
+#else
+  *capacity = 0;
+  return NULL;
+#endif
+}
+
+static void _write_negotiation(telnet_session_t *session, telnet_command_t command, telnet_option_t option,
+                               telnet_writer_t writer);
+static void _flush_replies(telnet_session_t *session, telnet_writer_t writer);
+static void _write_reply(telnet_session_t *session, const uint8_t *reply, size_t length, telnet_writer_t writer);
+static void _write_subnegotiation_reply(telnet_session_t *session, telnet_option_t option, const uint8_t *value,
+                                        telnet_writer_t writer);
+static bool _write_encoded(telnet_session_t *session, const uint8_t *data, size_t length, telnet_writer_t writer);
+
+// An option is enabled in the YES state, which is the yes bit without the pending bit
+static bool _option_enabled(const telnet_option_state_t *side, telnet_option_t option) {
+  uint32_t word = _bit_word(option);
+  return (((side->yes[word] & ~side->pending[word]) >> ((uint32_t)option & 31)) & 1) != 0;
+}
+
+// Apply a WILL or DO (enable) or a WONT or DONT (not enable) from the peer to one side of an option, as per the
+// RFC 1143 Q method. Only changes of state are answered, which is what keeps two peers from looping.
+static void _receive_negotiation(telnet_session_t *session, telnet_option_state_t *side, const uint32_t *supported,
+                                 telnet_option_t option, bool enable, telnet_command_t accept,
+                                 telnet_command_t refuse, telnet_writer_t writer) {
+  bool yes = _bit_get(side->yes, option);
+  bool pending = _bit_get(side->pending, option);
+  bool opposite = _bit_get(side->opposite, option);
+  bool enabled = yes && !pending;
+  bool reply = false;
+  bool agree = enable;
+
+  if (!pending) {
+    if (enable != yes) {
+      // NO or YES: answer a request to change the state, agreeing to enable only options we support
+      agree = enable && _bit_get(supported, option);
+      yes = agree;
+      reply = true;
+    }
+  } else if (yes) {
+    // WANTNO: the peer is answering our request to disable the option
+    if (!opposite) {
+      // An enable here is an error, the option ends up disabled either way
+      yes = false;
+      pending = false;
+    } else if (enable) {
+      pending = false;
+      opposite = false;
+    } else {
+      // We asked for it back while the disable was pending, so ask again
+      yes = false;
+      opposite = false;
+      agree = true;
+      reply = true;
+    }
+  } else {
+    // WANTYES: the peer is answering our request to enable the option
+    if (enable && opposite) {
+      // We asked to disable it while the enable was pending
+      yes = true;
+      opposite = false;
+      agree = false;
+      reply = true;
+    } else {
+      yes = enable;
+      pending = false;
+      opposite = false;
+    }
+  }
+
+  _bit_assign(side->yes, option, yes);
+  _bit_assign(side->pending, option, pending);
+  _bit_assign(side->opposite, option, opposite);
+  if (reply) {
+    _write_negotiation(session, agree ? accept : refuse, option, writer);
+  }
+
+  // Follow through on the negotiation script by asking for the value of an option the peer just enabled
+  const telnet_negotiation_script_t *script = session->negotiation_script;
+  if (!enabled && yes && !pending && script != NULL && side == &session->remote_options &&
+      _bit_get(script->queries, option)) {
+    const uint8_t query[6] = { TELNET_IAC, TELNET_SB, option, TELNET_SE_SEND, TELNET_IAC, TELNET_SE };
+    _write_reply(session, query, sizeof(query), writer);
+  }
 }
 
 static void _handle_incomming_packet(telnet_session_t *session, telnet_writer_t writer, telnet_packet_callback_t callback) {
@@ -152,7 +570,6 @@ static void _handle_incomming_packet(telnet_session_t *session, telnet_writer_t
   }
   
   telnet_packet_t *packet = &session->packet;
-  telnet_packet_t response_packet;
 
   bool automatic_response = true;
   if (callback != NULL) {
@@ -164,40 +581,22 @@ static void _handle_incomming_packet(telnet_session_t *session, telnet_writer_t
     return;
   }
 
-  telnet_init_packet(&response_packet);
-
   switch (packet->command) {
     case TELNET_WILL:
-      // Respond with DO if we support the option
-      if (telnet_get_option(session, packet->option)) {
-        response_packet.command = TELNET_DO;
-      } else {
-        response_packet.command = TELNET_DONT;
-      }
-      response_packet.option = packet->option;
-      telnet_write_packet(session, &response_packet, writer);
+      _receive_negotiation(session, &session->remote_options, session->profile->remote_supported,
+                           packet->option, true, TELNET_DO, TELNET_DONT, writer);
       break;
     case TELNET_WONT:
-      // Always respond with DONT
-      response_packet.command = TELNET_DONT;
-      response_packet.option = packet->option;
-      telnet_write_packet(session, &response_packet, writer);
+      _receive_negotiation(session, &session->remote_options, session->profile->remote_supported,
+                           packet->option, false, TELNET_DO, TELNET_DONT, writer);
       break;
     case TELNET_DO:
-      // Respond with WILL if we support the option
-      if (telnet_get_option(session, packet->option)) {
-        response_packet.command = TELNET_WILL;
-      } else {
-        response_packet.command = TELNET_WONT;
-      }
-      response_packet.option = packet->option;
-      telnet_write_packet(session, &response_packet, writer);
+      _receive_negotiation(session, &session->local_options, session->profile->local_supported,
+                           packet->option, true, TELNET_WILL, TELNET_WONT, writer);
       break;
     case TELNET_DONT:
-      // Always respond with WONT
-      response_packet.command = TELNET_WONT;
-      response_packet.option = packet->option;
-      telnet_write_packet(session, &response_packet, writer);
+      _receive_negotiation(session, &session->local_options, session->profile->local_supported,
+                           packet->option, false, TELNET_WILL, TELNET_WONT, writer);
       break;
     case TELNET_SB:
       // Handle subnegotiation if type is SEND.
@@ -205,12 +604,7 @@ static void _handle_incomming_packet(telnet_session_t *session, telnet_writer_t
         // If we have a subnegotiation option set, we can respond automatically
         const uint8_t *subnegotiation_option = telnet_get_subnegotiation_option(session, packet->option);
         if (subnegotiation_option != NULL) {
-          response_packet.command = TELNET_SB;
-          response_packet.option = packet->option;
-          response_packet.subnegotiation_type = TELNET_SE_IS;
-          response_packet.subnegotiation_length = strlen((const char*)subnegotiation_option);
-          memcpy(response_packet.subnegotiation_data, subnegotiation_option, response_packet.subnegotiation_length);
-          telnet_write_packet(session, &response_packet, writer);
+          _write_subnegotiation_reply(session, packet->option, subnegotiation_option, writer);
         }
       }
       break;
@@ -220,134 +614,1984 @@ static void _handle_incomming_packet(telnet_session_t *session, telnet_writer_t
   }
 }
 
-static size_t _delete_uint8_tacter(uint8_t *data, size_t length, size_t index) {
-  if (index >= length) {
-    return length;
+// Scanning kernels used to skip over plain data and to size escaped output.
+// The `_find_iac` kernels return the index of the first IAC in the buffer, or the length of the buffer if there is none.
+// The `_count_iac` kernels return the number of IAC bytes in the buffer.
+// The `_find_nvt` kernels find the bytes NVT output may change: IAC, CR and LF. The `_count_nvt` kernels return
+// how many bytes NVT output adds, one for each of those bytes except CR LF, which is already an NVT newline.
+typedef size_t (*telnet_scan_t)(const uint8_t *data, size_t length);
+
+// Word sized constants for finding 0xFF bytes a word at a time.
+#define _SWAR_ONES ((size_t)-1 / 0xFF)
+#define _SWAR_HIGHS (_SWAR_ONES * 0x80)
+
+static size_t _find_iac_swar(const uint8_t *data, size_t length) {
+  size_t i = 0;
+  for (; i + sizeof(size_t) <= length; i += sizeof(size_t)) {
+    size_t word;
+    memcpy(&word, &data[i], sizeof(word));
+    // A byte of the inverted word is zero exactly where the original byte was IAC
+    if (((~word - _SWAR_ONES) & word & _SWAR_HIGHS) != 0) {
+      break;
+    }
   }
-  
-  // Shift data left to remove uint8_tacter at index
-  memmove(&data[index], &data[index + 1], length - index - 1);
-  return length - 1; // Return new length
+  for (; i < length; i++) {
+    if (data[i] == TELNET_IAC) {
+      return i;
+    }
+  }
+  return length;
 }
 
-// Macro to handle deleting a uint8_tacter in the data buffer
-#define _TELNET_DELETE_CHARACTER \
-  do { \
-    new_length = _delete_uint8_tacter(data, new_length, i); \
-    i--; \
-  } while (0)
+// Set the high bit of each zero byte of a word, without borrows between bytes
+#define _SWAR_ZEROS(word) (~((((word) & ~_SWAR_HIGHS) + ~_SWAR_HIGHS) | (word)) & _SWAR_HIGHS)
+// Add up the high bits of a word
+#define _SWAR_COUNT(highs) (((((highs) >> 7) * _SWAR_ONES) >> ((sizeof(size_t) - 1) * 8)))
 
-size_t telnet_read(telnet_session_t *session, uint8_t *data, size_t length, telnet_packet_callback_t callback, telnet_writer_t writer) {
-  if (data == NULL || length == 0) {
-    return 0;
+#define _is_nvt_special(c) ((c) == TELNET_IAC || (c) == '\r' || (c) == '\n')
+
+// With NVT newlines each special byte becomes two bytes on output:
+// IAC becomes IAC IAC, a bare CR becomes CR NUL and a bare LF becomes CR LF.
+#define _escape_first(c) (((c) == '\n') ? '\r' : (c))
+#define _escape_second(c) (((c) == '\r') ? '\0' : (c))
+
+// True if the special byte at data[i] starts a CR LF, which NVT output sends as it is.
+// A CR at the end of the data is bare, even if the next write starts with LF.
+#define _is_crlf(data, i, length) ((data)[i] == '\r' && (i) + 1 < (length) && (data)[(i) + 1] == '\n')
+
+// Escape the special byte at data[i] into two bytes, returning how many bytes of the data they stand for
+static inline size_t _escape_special(const uint8_t *data, size_t i, size_t length, uint8_t *escape) {
+  if (_is_crlf(data, i, length)) {
+    escape[0] = '\r';
+    escape[1] = '\n';
+    return 2;
   }
-  if (session == NULL) {
-    return length;
+  escape[0] = _escape_first(data[i]);
+  escape[1] = _escape_second(data[i]);
+  return 1;
+}
+
+static size_t _count_iac_swar(const uint8_t *data, size_t length) {
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + sizeof(size_t) <= length; i += sizeof(size_t)) {
+    size_t word;
+    memcpy(&word, &data[i], sizeof(word));
+    count += _SWAR_COUNT(_SWAR_ZEROS(~word));
   }
-  
-  // Process incoming data
-  size_t new_length = length;
-  for (size_t i = 0; i < new_length; i++) {
-    uint8_t c = data[i];
-    
-    switch(session->state) {
-      case TELNET_STATE_READY:
-        if (c == TELNET_IAC) {
-          _TELNET_DELETE_CHARACTER;
-          session->state = TELNET_STATE_IN_COMMAND;
-        }
-        break;
-      case TELNET_STATE_IN_COMMAND:
-        session->packet.command = c;
-        if (c == TELNET_IAC) {
-          // Escape sequence, don't delete uint8_tacter
-          session->state = TELNET_STATE_READY;
-          break;
-        }
-        new_length = _delete_uint8_tacter(data, new_length, i);
-        i--;
-        if (c == TELNET_DO || c == TELNET_DONT || c == TELNET_WILL || c == TELNET_WONT) {
-          // Handle option negotiation
-          session->state = TELNET_STATE_IN_OPTION;
-        } else if (c == TELNET_SB) {
-          // Start of subnegotiation
-          session->state = TELNET_STATE_IN_SUBNEGOTIATION_TYPE;
-        } else {
-          // Other command
-          _handle_incomming_packet(session, writer, callback);
-          session->state = TELNET_STATE_READY;
-        }
-        break;
-      case TELNET_STATE_IN_OPTION:
-        _TELNET_DELETE_CHARACTER;
-        session->packet.option = c;
-        _handle_incomming_packet(session, writer, callback);
-        session->state = TELNET_STATE_READY;
-        break;
-      case TELNET_STATE_IN_SUBNEGOTIATION_TYPE:
-        _TELNET_DELETE_CHARACTER;
-        session->packet.subnegotiation_type = c;
-        session->state = TELNET_STATE_IN_SUBNEGOTIATION_VALUE;
-        break;
-      case TELNET_STATE_IN_SUBNEGOTIATION_VALUE:
-        _TELNET_DELETE_CHARACTER;
-        if (c == TELNET_IAC) {
-          session->state = TELNET_STATE_IN_SB_IAC;
-        } else {
-          session->packet.subnegotiation_data[session->packet.subnegotiation_length++] = c;
-        }
-        break;
-      case TELNET_STATE_IN_SB_IAC:
-        if (c == TELNET_IAC) {
-          // Double IAC means we escape it
-          session->packet.subnegotiation_data[session->packet.subnegotiation_length++] = TELNET_IAC;
-          session->state = TELNET_STATE_IN_SUBNEGOTIATION_VALUE;
-          _TELNET_DELETE_CHARACTER;
-        } else if (c == TELNET_SE) {
-          // End of subnegotiation
-          _handle_incomming_packet(session, writer, callback);
-          session->state = TELNET_STATE_READY;
-          _TELNET_DELETE_CHARACTER;
-        } else {
-          // Handle the previous packet
-          _handle_incomming_packet(session, writer, callback);
-          // Begin handling of a new packet
-          telnet_init_packet(&session->packet);
-          session->state = TELNET_STATE_IN_COMMAND;
-        }
+  for (; i < length; i++) {
+    count += (data[i] == TELNET_IAC);
+  }
+  return count;
+}
+
+static size_t _find_nvt_swar(const uint8_t *data, size_t length) {
+  size_t i = 0;
+  for (; i + sizeof(size_t) <= length; i += sizeof(size_t)) {
+    size_t word;
+    memcpy(&word, &data[i], sizeof(word));
+    size_t found = _SWAR_ZEROS(~word) | _SWAR_ZEROS(word ^ (_SWAR_ONES * '\r')) | _SWAR_ZEROS(word ^ (_SWAR_ONES * '\n'));
+    if (found != 0) {
+      break;
+    }
+  }
+  for (; i < length; i++) {
+    if (_is_nvt_special(data[i])) {
+      return i;
     }
   }
-  return new_length;
+  return length;
 }
 
-void telnet_write(telnet_session_t *session, const uint8_t *data, size_t length, telnet_writer_t writer) {
-  if (session == NULL || data == NULL || length == 0 || writer == NULL) {
-    return;
+// Each CR LF counts as two special bytes but adds nothing, so it is taken off twice.
+// The word one byte further on lines up every CR with the byte after it, whatever the byte order.
+static size_t _count_nvt_swar(const uint8_t *data, size_t length) {
+  size_t count = 0;
+  size_t crlf = 0;
+  size_t i = 0;
+  for (; i + sizeof(size_t) < length; i += sizeof(size_t)) {
+    size_t word;
+    size_t next;
+    memcpy(&word, &data[i], sizeof(word));
+    memcpy(&next, &data[i + 1], sizeof(next));
+    size_t cr = _SWAR_ZEROS(word ^ (_SWAR_ONES * '\r'));
+    size_t found = _SWAR_ZEROS(~word) | cr | _SWAR_ZEROS(word ^ (_SWAR_ONES * '\n'));
+    count += _SWAR_COUNT(found);
+    crlf += _SWAR_COUNT(cr & _SWAR_ZEROS(next ^ (_SWAR_ONES * '\n')));
   }
+  for (; i < length; i++) {
+    count += _is_nvt_special(data[i]);
+    crlf += _is_crlf(data, i, length);
+  }
+  return count - 2 * crlf;
+}
 
-  uint8_t escape[2] = { TELNET_IAC, TELNET_IAC };
+#ifdef TELNET_X86_SIMD
+// The wider kernels clear the upper halves of the vector registers before they return or hand the rest of the
+// data to a narrower kernel. The compiler does not always do this for `target` functions, and SSE code that runs
+// while the upper halves are dirty, in the narrower kernels or anywhere else, pays a heavy penalty for each instruction.
+__attribute__((target("sse2")))
+static size_t _find_iac_sse2(const uint8_t *data, size_t length) {
+  const __m128i iac = _mm_set1_epi8((char)TELNET_IAC);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&data[i]);
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, iac));
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+  return i + _find_iac_swar(&data[i], length - i);
+}
 
-  size_t start = 0;
-  size_t new_length = 0;
+__attribute__((target("avx2")))
+static size_t _find_iac_avx2(const uint8_t *data, size_t length) {
+  const __m256i iac = _mm256_set1_epi8((char)TELNET_IAC);
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&data[i]);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, iac));
+    if (mask != 0) {
+      _mm256_zeroupper();
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+  _mm256_zeroupper();
+  return i + _find_iac_sse2(&data[i], length - i);
+}
 
-  for (size_t i = 0; i < length; i++) {
-    uint8_t c = data[i];
-    new_length++;
-    
-    // Check for IAC (Interpret As Command) and escape it
-    if (c == TELNET_IAC) {
-      // Write the data before IAC
-      writer(session, data + start, new_length); 
-      // Write the escape sequence
-      writer(session, escape, 2); 
-      // Reset start and new_length
-      start = i + 1;
-      new_length = 0;
+__attribute__((target("avx512f,avx512bw")))
+static size_t _find_iac_avx512(const uint8_t *data, size_t length) {
+  const __m512i iac = _mm512_set1_epi8((char)TELNET_IAC);
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m512i block = _mm512_loadu_si512((const void *)&data[i]);
+    unsigned long long mask = _mm512_cmpeq_epi8_mask(block, iac);
+    if (mask != 0) {
+      _mm256_zeroupper();
+      return i + (size_t)__builtin_ctzll(mask);
     }
   }
+  _mm256_zeroupper();
+  return i + _find_iac_avx2(&data[i], length - i);
+}
+
+__attribute__((target("sse2")))
+static size_t _count_iac_sse2(const uint8_t *data, size_t length) {
+  const __m128i iac = _mm_set1_epi8((char)TELNET_IAC);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&data[i]);
+    count += (size_t)__builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, iac)));
+  }
+  return count + _count_iac_swar(&data[i], length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t _count_iac_avx2(const uint8_t *data, size_t length) {
+  const __m256i iac = _mm256_set1_epi8((char)TELNET_IAC);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&data[i]);
+    count += (size_t)__builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, iac)));
+  }
+  _mm256_zeroupper();
+  return count + _count_iac_sse2(&data[i], length - i);
+}
 
-  // Write the remaining data
-  writer(session, data + start, new_length);
+__attribute__((target("avx512f,avx512bw")))
+static size_t _count_iac_avx512(const uint8_t *data, size_t length) {
+  const __m512i iac = _mm512_set1_epi8((char)TELNET_IAC);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m512i block = _mm512_loadu_si512((const void *)&data[i]);
+    count += (size_t)__builtin_popcountll(_mm512_cmpeq_epi8_mask(block, iac));
+  }
+  _mm256_zeroupper();
+  return count + _count_iac_avx2(&data[i], length - i);
+}
+
+__attribute__((target("sse2")))
+static inline unsigned _nvt_mask_sse2(__m128i block) {
+  __m128i found = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8((char)TELNET_IAC)),
+                               _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))));
+  return (unsigned)_mm_movemask_epi8(found);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned _nvt_mask_avx2(__m256i block) {
+  __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8((char)TELNET_IAC)),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')),
+                                                  _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n'))));
+  return (unsigned)_mm256_movemask_epi8(found);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline unsigned long long _nvt_mask_avx512(__m512i block) {
+  return _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8((char)TELNET_IAC)) |
+         _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8('\r')) |
+         _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8('\n'));
+}
+
+__attribute__((target("sse2")))
+static size_t _find_nvt_sse2(const uint8_t *data, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    unsigned mask = _nvt_mask_sse2(_mm_loadu_si128((const __m128i *)&data[i]));
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+  return i + _find_nvt_swar(&data[i], length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t _find_nvt_avx2(const uint8_t *data, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    unsigned mask = _nvt_mask_avx2(_mm256_loadu_si256((const __m256i *)&data[i]));
+    if (mask != 0) {
+      _mm256_zeroupper();
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+  _mm256_zeroupper();
+  return i + _find_nvt_sse2(&data[i], length - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t _find_nvt_avx512(const uint8_t *data, size_t length) {
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    unsigned long long mask = _nvt_mask_avx512(_mm512_loadu_si512((const void *)&data[i]));
+    if (mask != 0) {
+      _mm256_zeroupper();
+      return i + (size_t)__builtin_ctzll(mask);
+    }
+  }
+  _mm256_zeroupper();
+  return i + _find_nvt_avx2(&data[i], length - i);
+}
+
+__attribute__((target("sse2")))
+static size_t _count_nvt_sse2(const uint8_t *data, size_t length) {
+  size_t count = 0;
+  size_t crlf = 0;
+  size_t i = 0;
+  for (; i + 16 < length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&data[i]);
+    __m128i next = _mm_loadu_si128((const __m128i *)&data[i + 1]);
+    __m128i pairs = _mm_and_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')),
+                                  _mm_cmpeq_epi8(next, _mm_set1_epi8('\n')));
+    count += (size_t)__builtin_popcount(_nvt_mask_sse2(block));
+    crlf += (size_t)__builtin_popcount((unsigned)_mm_movemask_epi8(pairs));
+  }
+  return count - 2 * crlf + _count_nvt_swar(&data[i], length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t _count_nvt_avx2(const uint8_t *data, size_t length) {
+  size_t count = 0;
+  size_t crlf = 0;
+  size_t i = 0;
+  for (; i + 32 < length; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&data[i]);
+    __m256i next = _mm256_loadu_si256((const __m256i *)&data[i + 1]);
+    __m256i pairs = _mm256_and_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')),
+                                     _mm256_cmpeq_epi8(next, _mm256_set1_epi8('\n')));
+    count += (size_t)__builtin_popcount(_nvt_mask_avx2(block));
+    crlf += (size_t)__builtin_popcount((unsigned)_mm256_movemask_epi8(pairs));
+  }
+  _mm256_zeroupper();
+  return count - 2 * crlf + _count_nvt_sse2(&data[i], length - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t _count_nvt_avx512(const uint8_t *data, size_t length) {
+  size_t count = 0;
+  size_t crlf = 0;
+  size_t i = 0;
+  for (; i + 64 < length; i += 64) {
+    __m512i block = _mm512_loadu_si512((const void *)&data[i]);
+    __m512i next = _mm512_loadu_si512((const void *)&data[i + 1]);
+    unsigned long long pairs = _mm512_cmpeq_epi8_mask(block, _mm512_set1_epi8('\r')) &
+                               _mm512_cmpeq_epi8_mask(next, _mm512_set1_epi8('\n'));
+    count += (size_t)__builtin_popcountll(_nvt_mask_avx512(block));
+    crlf += (size_t)__builtin_popcountll(pairs);
+  }
+  _mm256_zeroupper();
+  return count - 2 * crlf + _count_nvt_avx2(&data[i], length - i);
+}
+#endif
+
+#ifdef TELNET_X86_SIMD
+#define _KERNELS(name) { name##_swar, name##_sse2, name##_avx2, name##_avx512 }
+#else
+#define _KERNELS(name) { name##_swar, name##_swar, name##_swar, name##_swar }
+#endif
+
+// The kernels in use. They start out as the portable ones, which work everywhere.
+static telnet_scan_t _find_iac = _find_iac_swar;
+static telnet_scan_t _count_iac = _count_iac_swar;
+static telnet_scan_t _find_nvt = _find_nvt_swar;
+static telnet_scan_t _count_nvt = _count_nvt_swar;
+
+#ifdef TELNET_X86_SIMD
+// Pick the widest kernel the CPU supports. The kernels are listed from the portable one to the widest.
+static telnet_scan_t _select_kernel(const telnet_scan_t kernels[4]) {
+  if (__builtin_cpu_supports("avx512bw")) {
+    return kernels[3];
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return kernels[2];
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return kernels[1];
+  }
+  return kernels[0];
+}
+
+// Kernels are chosen once, when the program is loaded and before any thread can be reading with them,
+// so they never change while they are in use.
+__attribute__((constructor)) static void _select_kernels(void) {
+  static const telnet_scan_t find_iac[4] = _KERNELS(_find_iac);
+  static const telnet_scan_t count_iac[4] = _KERNELS(_count_iac);
+  static const telnet_scan_t find_nvt[4] = _KERNELS(_find_nvt);
+  static const telnet_scan_t count_nvt[4] = _KERNELS(_count_nvt);
+  __builtin_cpu_init();
+  _find_iac = _select_kernel(find_iac);
+  _count_iac = _select_kernel(count_iac);
+  _find_nvt = _select_kernel(find_nvt);
+  _count_nvt = _select_kernel(count_nvt);
+}
+#endif
+
+// Where the parser delivers what it reads.
+// Data is either copied into `output` or, when `events` is set, described by events that point into the input.
+typedef struct {
+  uint8_t *output;
+  size_t capacity;
+  size_t length;
+  bool in_place;
+  telnet_event_t *events;
+  size_t max_events;
+  size_t event_count;
+  // A byte owed from an earlier read that had no room yet when parsing in place, to be inserted at `insert_at`
+  bool inserting;
+  size_t insert_at;
+  uint8_t insert;
+} telnet_sink_t;
+
+static void _add_event(telnet_sink_t *sink, telnet_event_type_t type, const uint8_t *data, size_t length, const telnet_packet_t *packet) {
+  telnet_event_t *event = &sink->events[sink->event_count++];
+  event->type = type;
+  event->data = data;
+  event->length = length;
+  if (packet != NULL) {
+    event->command = packet->command;
+    event->option = packet->option;
+    event->subnegotiation_type = packet->subnegotiation_type;
+  } else {
+    event->command = TELNET_NOP;
+    event->option = TELNET_OPTION_BINARY;
+    event->subnegotiation_type = TELNET_SE_IS;
+  }
+}
+
+// Hand all collected packets to the batch callback
+static void _flush_packet_batch(telnet_session_t *session) {
+  telnet_packet_batch_t *batch = session->packet_batch;
+  if (batch == NULL) {
+    return;
+  }
+  if (batch->count > 0) {
+    batch->callback(session, batch->packets, batch->count);
+  }
+  batch->count = 0;
+  batch->has_subnegotiation = false;
+}
+
+// Find the handler for a packet in a dispatch table. An option's own handler comes first, then the command's.
+static telnet_packet_callback_t _dispatch_handler(const telnet_dispatch_t *dispatch, const telnet_packet_t *packet) {
+  // Commands outside EOR to DONT, such as unknown command bytes, have no slot
+  uint32_t command = (uint32_t)(packet->command - TELNET_EOR);
+  if (command >= sizeof(dispatch->command_slots)) {
+    return NULL;
+  }
+  uint8_t slot = 0;
+  if (packet->command >= TELNET_SB) {
+    slot = dispatch->option_slots[(uint8_t)packet->option];
+  }
+  if (slot == 0) {
+    slot = dispatch->command_slots[command];
+  }
+  return dispatch->handlers[slot];
+}
+
+// Deliver the packet in the session to the sink and the application
+static void _dispatch_packet(telnet_session_t *session, telnet_sink_t *sink, telnet_packet_callback_t callback, telnet_writer_t writer) {
+  if (sink->events != NULL) {
+    _add_event(sink, TELNET_EVENT_COMMAND, NULL, 0, &session->packet);
+  } else if (session->packet.command == TELNET_SB && session->subnegotiation_stream != NULL) {
+    // Streamed subnegotiations are finished by the end callback instead of the packet callback
+    callback = session->subnegotiation_stream->end;
+  } else {
+    if (session->packet.command == TELNET_SB) {
+      size_t capacity;
+      session->packet.subnegotiation_data = _subnegotiation_buffer(session, &capacity);
+    } else {
+      // Other packets have no data, and must not point at the data of an earlier subnegotiation
+      session->packet.subnegotiation_data = NULL;
+      session->packet.subnegotiation_length = 0;
+    }
+    telnet_packet_callback_t handler = NULL;
+    if (session->dispatch != NULL) {
+      handler = _dispatch_handler(session->dispatch, &session->packet);
+    }
+    if (handler != NULL) {
+      // Handlers from the dispatch table take the packet directly
+      callback = handler;
+    } else if (session->packet_batch != NULL) {
+      // Collect the packet for the batch callback, batched packets always get automatic responses
+      telnet_packet_batch_t *batch = session->packet_batch;
+      if (batch->count == batch->capacity) {
+        _flush_packet_batch(session);
+      }
+      batch->packets[batch->count++] = session->packet;
+      if (session->packet.command == TELNET_SB) {
+        batch->has_subnegotiation = true;
+      }
+      callback = NULL;
+    }
+  }
+  _handle_incomming_packet(session, writer, callback);
+}
+
+// Called once the option and type of a subnegotiation are known
+static void _begin_subnegotiation(telnet_session_t *session, telnet_sink_t *sink) {
+  const telnet_subnegotiation_stream_t *stream = session->subnegotiation_stream;
+  if (sink->events == NULL && stream != NULL && stream->begin != NULL) {
+    stream->begin(session, session->packet.option, session->packet.subnegotiation_type);
+  }
+}
+
+// The parser works out what to do with each byte from its state and the byte,
+// then performs one of the following actions.
+#define TELNET_ACTION_DATA         0  /* Plain data, up to the next IAC */
+#define TELNET_ACTION_LITERAL      1  /* Escaped IAC in the data */
+#define TELNET_ACTION_NEGOTIATE    2  /* DO, DONT, WILL or WONT, an option follows */
+#define TELNET_ACTION_SUBNEGOTIATE 3  /* SB, an option follows */
+#define TELNET_ACTION_COMMAND      4  /* Any other command */
+#define TELNET_ACTION_OPTION       5  /* Option of a negotiation */
+#define TELNET_ACTION_SB_OPTION    6  /* Option of a subnegotiation */
+#define TELNET_ACTION_SB_TYPE      7  /* Type of a subnegotiation */
+#define TELNET_ACTION_SB_EMPTY     8  /* IAC where the subnegotiation type was expected */
+#define TELNET_ACTION_SB_DATA      9  /* Subnegotiation data, up to the next IAC */
+#define TELNET_ACTION_SB_LITERAL   10 /* Escaped IAC in subnegotiation data */
+#define TELNET_ACTION_SB_END       11 /* SE, end of subnegotiation */
+#define TELNET_ACTION_SB_ABORT     12 /* Another command ends the subnegotiation */
+
+// The transition rules. This is evaluated at run time by the switch based parser
+// and at compile time to build the tables for the table driven parser.
+#define _TELNET_ACTION(state, c) \
+  ((state) == TELNET_STATE_READY ? TELNET_ACTION_DATA : \
+   (state) == TELNET_STATE_IN_COMMAND ? \
+     ((c) == TELNET_IAC ? TELNET_ACTION_LITERAL : \
+      (c) >= TELNET_WILL ? TELNET_ACTION_NEGOTIATE : \
+      (c) == TELNET_SB ? TELNET_ACTION_SUBNEGOTIATE : TELNET_ACTION_COMMAND) : \
+   (state) == TELNET_STATE_IN_OPTION ? TELNET_ACTION_OPTION : \
+   (state) == TELNET_STATE_IN_SUBNEGOTIATION_OPTION ? TELNET_ACTION_SB_OPTION : \
+   (state) == TELNET_STATE_IN_SUBNEGOTIATION_TYPE ? \
+     ((c) == TELNET_IAC ? TELNET_ACTION_SB_EMPTY : TELNET_ACTION_SB_TYPE) : \
+   (state) == TELNET_STATE_IN_SUBNEGOTIATION_VALUE ? TELNET_ACTION_SB_DATA : \
+     ((c) == TELNET_IAC ? TELNET_ACTION_SB_LITERAL : \
+      (c) == TELNET_SE ? TELNET_ACTION_SB_END : TELNET_ACTION_SB_ABORT))
+
+#ifdef TELNET_TABLE_PARSER
+// Every byte below SE is plain data and all bytes in a class behave the same in every state,
+// so the parser only needs a transition table of states by byte classes.
+#define TELNET_CLASS_DATA      0
+#define TELNET_CLASS_SE        1
+#define TELNET_CLASS_COMMAND   2
+#define TELNET_CLASS_SB        3
+#define TELNET_CLASS_NEGOTIATE 4
+#define TELNET_CLASS_IAC       5
+#define TELNET_CLASS_COUNT     6
+
+#define _CLASS(c) \
+  ((c) < TELNET_SE ? TELNET_CLASS_DATA : (c) == TELNET_SE ? TELNET_CLASS_SE : \
+   (c) < TELNET_SB ? TELNET_CLASS_COMMAND : (c) == TELNET_SB ? TELNET_CLASS_SB : \
+   (c) < TELNET_IAC ? TELNET_CLASS_NEGOTIATE : TELNET_CLASS_IAC)
+#define _CLASS4(c) _CLASS(c), _CLASS((c) + 1), _CLASS((c) + 2), _CLASS((c) + 3)
+#define _CLASS16(c) _CLASS4(c), _CLASS4((c) + 4), _CLASS4((c) + 8), _CLASS4((c) + 12)
+#define _CLASS64(c) _CLASS16(c), _CLASS16((c) + 16), _CLASS16((c) + 32), _CLASS16((c) + 48)
+
+static const uint8_t _byte_classes[256] = {
+  _CLASS64(0), _CLASS64(64), _CLASS64(128), _CLASS64(192)
+};
+
+// A byte that belongs to each class, in class order
+#define _ACTIONS(state) { \
+    _TELNET_ACTION(state, 0), _TELNET_ACTION(state, TELNET_SE), _TELNET_ACTION(state, TELNET_NOP), \
+    _TELNET_ACTION(state, TELNET_SB), _TELNET_ACTION(state, TELNET_WILL), _TELNET_ACTION(state, TELNET_IAC) \
+  }
+
+// Indexed by parser state, in the order of the TELNET_STATE_* values
+static const uint8_t _transitions[][TELNET_CLASS_COUNT] = {
+  _ACTIONS(TELNET_STATE_READY),
+  _ACTIONS(TELNET_STATE_IN_COMMAND),
+  _ACTIONS(TELNET_STATE_IN_OPTION),
+  _ACTIONS(TELNET_STATE_IN_SUBNEGOTIATION_TYPE),
+  _ACTIONS(TELNET_STATE_IN_SUBNEGOTIATION_VALUE),
+  _ACTIONS(TELNET_STATE_IN_SB_IAC),
+  _ACTIONS(TELNET_STATE_IN_SUBNEGOTIATION_OPTION)
+};
+
+#define _next_action(state, c) (_transitions[(state)][_byte_classes[(c)]])
+#else
+#define _next_action(state, c) _TELNET_ACTION((state), (c))
+#endif
+
+// Write a byte owed from an earlier call ahead of the byte at the read cursor.
+// When parsing in place the owed byte only fits once something has been removed from the buffer. Until then it is
+// recorded in the sink and inserted when the whole buffer has been parsed, using the spare byte after the buffer if
+// nothing was removed. This happens at most once per read, as anything owed is resolved by the first data byte and
+// leaves room behind it.
+// Otherwise the owed byte is written on its own, and the byte at the read cursor waits for the next call if
+// that filled the output.
+// Returns false if the output is full.
+static bool _put_owed(telnet_sink_t *sink, size_t *out, size_t i, uint8_t byte) {
+  if (sink->in_place) {
+    if (*out < i) {
+      sink->output[(*out)++] = byte;
+    } else {
+      sink->inserting = true;
+      sink->insert_at = *out;
+      sink->insert = byte;
+    }
+    return true;
+  }
+  if (*out == sink->capacity) {
+    return false;
+  }
+  sink->output[(*out)++] = byte;
+  return true;
+}
+
+// Copy plain data up to the next IAC while translating NVT newlines, CR LF becomes LF and CR NUL becomes CR.
+// A CR at the end of the data is held back until the next byte shows what it means.
+// If `translate` is false, only a CR held back by an earlier call is dealt with and everything else is copied as is.
+// Returns false if the output filled up before the next IAC.
+static bool _copy_nvt_data(telnet_session_t *session, const uint8_t *data, size_t length, size_t *index, size_t literal,
+                           telnet_sink_t *sink, size_t *out, bool translate) {
+  uint8_t *output = sink->output;
+  size_t i = *index;
+  size_t end = *out;
+  bool complete = true;
+  for (; i < length; i++) {
+    uint8_t c = data[i];
+    if (c == TELNET_IAC && literal == 0) {
+      break;
+    }
+    literal = 0;
+    if ((session->flags & _FLAG_PENDING_CR) != 0) {
+      if (c == '\n' || c == '\0') {
+        // The pair becomes a single byte
+        if (end == sink->capacity) {
+          complete = false;
+          break;
+        }
+        session->flags &= ~(uint32_t)_FLAG_PENDING_CR;
+        output[end++] = (c == '\n') ? '\n' : '\r';
+        continue;
+      }
+      // A bare CR is not valid NVT data, but pass it on
+      if (!_put_owed(sink, &end, i, '\r')) {
+        complete = false;
+        break;
+      }
+      session->flags &= ~(uint32_t)_FLAG_PENDING_CR;
+    }
+    if (c == '\r' && translate) {
+      session->flags |= _FLAG_PENDING_CR;
+      continue;
+    }
+    if (end == sink->capacity) {
+      complete = false;
+      break;
+    }
+    output[end++] = c;
+  }
+  *index = i;
+  *out = end;
+  return complete;
+}
+
+// Parse telnet data from `data` into the sink. The sink output may be the same buffer as `data` but must not otherwise overlap it.
+// Parsing stops early when the sink is full and the next byte would need room in it.
+// Returns the number of bytes read from `data`.
+static size_t _telnet_parse(telnet_session_t *session, const uint8_t *data, size_t length, telnet_sink_t *sink,
+                            telnet_packet_callback_t callback, telnet_writer_t writer) {
+  // Process incoming data using separate read and write cursors.
+  // Data bytes are copied to the write cursor as they are read, so each byte is moved at most once
+  // and the cost of removing telnet commands stays linear in the size of the buffer.
+  // When producing events, no data is copied at all.
+  uint8_t *output = sink->output;
+  size_t out = sink->length;
+  size_t i = 0;
+  // Set when the byte at the read cursor is an escaped IAC that must be treated as data
+  size_t literal = 0;
+  // Set when the output filled up in the middle of a run of data
+  bool full = false;
+  while (i < length && !full) {
+    uint8_t c = data[i];
+
+    // Stop when the sink is full, the caller can resume from here
+    if (sink->events != NULL) {
+      if (sink->event_count == sink->max_events) {
+        break;
+      }
+    } else if (out == sink->capacity && ((session->state == TELNET_STATE_READY && c != TELNET_IAC) ||
+                                         (session->state == TELNET_STATE_IN_COMMAND && c == TELNET_IAC))) {
+      break;
+    }
+    
+    switch(_next_action(session->state, c)) {
+      case TELNET_ACTION_DATA: {
+        if (sink->events != NULL) {
+          // Report everything up to the next IAC as a single span of the input
+          size_t start = i;
+          i += literal;
+          i += _find_iac(&data[i], length - i);
+          if (i > start) {
+            _add_event(sink, TELNET_EVENT_DATA, &data[start], i - start, NULL);
+          }
+        } else if (session->input_newlines != TELNET_NEWLINE_NONE ||
+                   (session->flags & _FLAG_PENDING_CR) != 0) {
+          // Newlines are translated as the data is copied, unless the peer is sending binary data
+          bool translate = session->input_newlines != TELNET_NEWLINE_NONE &&
+                           !_option_enabled(&session->remote_options, TELNET_OPTION_BINARY);
+          size_t start = i;
+          if (!_copy_nvt_data(session, data, length, &i, literal, sink, &out, translate)) {
+            if (literal && i == start) {
+              // Read the escaped IAC again when resuming
+              session->state = TELNET_STATE_IN_COMMAND;
+            }
+            full = true;
+            continue;
+          }
+        } else {
+          // Short runs between commands are copied a byte at a time,
+          // longer ones are skipped with the scanning kernel and moved as a single block.
+          size_t limit = (length - i < sink->capacity - out) ? length : i + (sink->capacity - out);
+          size_t end = (limit - i < 16) ? limit : i + 16;
+          if (literal) {
+            output[out++] = data[i++];
+          }
+          while (i < end && data[i] != TELNET_IAC) {
+            output[out++] = data[i++];
+          }
+          if (i == end && i < limit) {
+            size_t run = _find_iac(&data[i], limit - i);
+            if (&output[out] != &data[i]) {
+              memmove(&output[out], &data[i], run);
+            }
+            out += run;
+            i += run;
+          }
+        }
+        literal = 0;
+        if (i < length && data[i] == TELNET_IAC) {
+          session->state = TELNET_STATE_IN_COMMAND;
+          i++;
+        }
+        continue;
+      }
+      case TELNET_ACTION_LITERAL:
+        // Escape sequence, the second IAC is data
+        session->packet.command = c;
+        session->state = TELNET_STATE_READY;
+        literal = 1;
+        continue;
+      case TELNET_ACTION_NEGOTIATE:
+        // Handle option negotiation
+        session->packet.command = c;
+        session->state = TELNET_STATE_IN_OPTION;
+        break;
+      case TELNET_ACTION_SUBNEGOTIATE:
+        // Start of subnegotiation
+        if (session->packet_batch != NULL && session->packet_batch->has_subnegotiation) {
+          // A batched subnegotiation still points at the subnegotiation buffer, deliver it before it is reused
+          _flush_packet_batch(session);
+        }
+        session->packet.command = c;
+        session->packet.subnegotiation_type = TELNET_SE_IS;
+        session->packet.subnegotiation_length = 0;
+        session->state = TELNET_STATE_IN_SUBNEGOTIATION_OPTION;
+        break;
+      case TELNET_ACTION_COMMAND:
+        // Other command
+        session->packet.command = c;
+        _dispatch_packet(session, sink, callback, writer);
+        session->state = TELNET_STATE_READY;
+        break;
+      case TELNET_ACTION_OPTION:
+        session->packet.option = c;
+        _dispatch_packet(session, sink, callback, writer);
+        session->state = TELNET_STATE_READY;
+        break;
+      case TELNET_ACTION_SB_OPTION:
+        session->packet.option = c;
+        session->state = TELNET_STATE_IN_SUBNEGOTIATION_TYPE;
+        break;
+      case TELNET_ACTION_SB_TYPE:
+        session->packet.subnegotiation_type = c;
+        session->state = TELNET_STATE_IN_SUBNEGOTIATION_VALUE;
+        _begin_subnegotiation(session, sink);
+        break;
+      case TELNET_ACTION_SB_EMPTY:
+        // Subnegotiation without any data
+        session->state = TELNET_STATE_IN_SB_IAC;
+        _begin_subnegotiation(session, sink);
+        break;
+      case TELNET_ACTION_SB_DATA: {
+        // Take everything up to the next IAC as subnegotiation data
+        size_t start = i;
+        i += literal;
+        i += _find_iac(&data[i], length - i);
+        literal = 0;
+        if (sink->events != NULL) {
+          if (i > start) {
+            _add_event(sink, TELNET_EVENT_SUBNEGOTIATION_DATA, &data[start], i - start, &session->packet);
+          }
+        } else if (session->subnegotiation_stream != NULL) {
+          // Hand the data straight from the input buffer to the application
+          if (i > start) {
+            session->subnegotiation_stream->data(session, &data[start], i - start);
+          }
+        } else {
+          // Anything that does not fit in the subnegotiation buffer is dropped
+          size_t capacity;
+          uint8_t *buffer = _subnegotiation_buffer(session, &capacity);
+          size_t room = capacity - session->packet.subnegotiation_length;
+          size_t count = (i - start < room) ? i - start : room;
+          if (count > 0) {
+            memcpy(&buffer[session->packet.subnegotiation_length], &data[start], count);
+            session->packet.subnegotiation_length += count;
+          }
+        }
+        if (i < length) {
+          session->state = TELNET_STATE_IN_SB_IAC;
+          i++;
+        }
+        continue;
+      }
+      case TELNET_ACTION_SB_LITERAL:
+        // Double IAC means we escape it
+        session->state = TELNET_STATE_IN_SUBNEGOTIATION_VALUE;
+        literal = 1;
+        continue;
+      case TELNET_ACTION_SB_END:
+        // End of subnegotiation
+        _dispatch_packet(session, sink, callback, writer);
+        session->state = TELNET_STATE_READY;
+        break;
+      case TELNET_ACTION_SB_ABORT:
+        // Handle the previous packet
+        _dispatch_packet(session, sink, callback, writer);
+        // Begin handling of a new packet, this byte is its command
+        telnet_init_packet(&session->packet);
+        session->state = TELNET_STATE_IN_COMMAND;
+        continue;
+    }
+    i++;
+  }
+  sink->length = out;
+  return i;
+}
+
+size_t telnet_read(telnet_session_t *session, uint8_t *data, size_t length, telnet_packet_callback_t callback, telnet_writer_t writer) {
+  if (data == NULL || length == 0) {
+    return 0;
+  }
+  if (session == NULL) {
+    return length;
+  }
+  
+  // Parse in place, the write cursor never passes the read cursor so the whole buffer is always consumed.
+  // Only a CR owed from the last read can make the data one byte longer, see `_put_owed`.
+  telnet_sink_t sink = { data, length, 0, true, NULL, 0, 0, false, 0, 0 };
+  _telnet_parse(session, data, length, &sink, callback, writer);
+  _flush_packet_batch(session);
+  _flush_replies(session, writer);
+  if (sink.inserting) {
+    // Make room for the byte owed from the last read, which takes the spare byte if nothing was removed
+    memmove(&data[sink.insert_at + 1], &data[sink.insert_at], sink.length - sink.insert_at);
+    data[sink.insert_at] = sink.insert;
+    sink.length++;
+  }
+  return sink.length;
+}
+
+size_t telnet_read_into(telnet_session_t *session, const uint8_t *data, size_t length, uint8_t *output, size_t capacity,
+                        size_t *consumed, telnet_packet_callback_t callback, telnet_writer_t writer) {
+  if (consumed != NULL) {
+    *consumed = 0;
+  }
+  if (session == NULL || data == NULL || length == 0 || output == NULL) {
+    return 0;
+  }
+  
+  telnet_sink_t sink = { output, capacity, 0, false, NULL, 0, 0, false, 0, 0 };
+  size_t read = _telnet_parse(session, data, length, &sink, callback, writer);
+  _flush_packet_batch(session);
+  _flush_replies(session, writer);
+  if (consumed != NULL) {
+    *consumed = read;
+  }
+  return sink.length;
+}
+
+size_t telnet_read_events(telnet_session_t *session, const uint8_t *data, size_t length, telnet_event_t *events, size_t max_events,
+                          size_t *consumed, telnet_writer_t writer) {
+  if (consumed != NULL) {
+    *consumed = 0;
+  }
+  if (session == NULL || data == NULL || length == 0 || events == NULL || max_events == 0) {
+    return 0;
+  }
+  
+  telnet_sink_t sink = { NULL, 0, 0, false, events, max_events, 0, false, 0, 0 };
+  size_t read = _telnet_parse(session, data, length, &sink, NULL, writer);
+  _flush_replies(session, writer);
+  if (consumed != NULL) {
+    *consumed = read;
+  }
+  return sink.event_count;
+}
+
+// Escape as much data as fits in a buffer, without splitting an escaped byte, optionally translating newlines.
+// Short runs between escaped bytes are copied a byte at a time,
+// longer ones are found with the scanning kernel and copied as a single block.
+static size_t _escape(const uint8_t *data, size_t length, size_t *consumed, uint8_t *output, size_t capacity, bool nvt) {
+  telnet_scan_t scan = nvt ? _find_nvt : _find_iac;
+  size_t out = 0;
+  size_t i = 0;
+  while (i < length && out < capacity) {
+    size_t limit = (length - i < capacity - out) ? length : i + (capacity - out);
+    size_t end = (limit - i < 16) ? limit : i + 16;
+    if (nvt) {
+      while (i < end && !_is_nvt_special(data[i])) {
+        output[out++] = data[i++];
+      }
+    } else {
+      while (i < end && data[i] != TELNET_IAC) {
+        output[out++] = data[i++];
+      }
+    }
+    if (i == end && i < limit) {
+      size_t run = scan(&data[i], limit - i);
+      memcpy(&output[out], &data[i], run);
+      out += run;
+      i += run;
+    }
+    if (i < limit) {
+      if (capacity - out < 2) {
+        break;
+      }
+      i += _escape_special(data, i, length, &output[out]);
+      out += 2;
+    }
+  }
+  *consumed = i;
+  return out;
+}
+
+// Output that is being staged for a writer
+typedef struct {
+  telnet_session_t *session;
+  telnet_writer_t writer;
+  uint8_t *buffer;
+  size_t capacity;
+  size_t length;
+} telnet_output_t;
+
+static void _output_flush(telnet_output_t *output) {
+  if (output->length > 0) {
+    output->writer(output->session, output->buffer, output->length);
+    output->length = 0;
+  }
+}
+
+// Add data to the staged output. Data too big for the buffer is passed straight to the writer.
+static void _output_append(telnet_output_t *output, const uint8_t *data, size_t length) {
+  if (length > output->capacity - output->length) {
+    _output_flush(output);
+    if (length >= output->capacity) {
+      output->writer(output->session, data, length);
+      return;
+    }
+  }
+  memcpy(&output->buffer[output->length], data, length);
+  output->length += length;
+}
+
+// Add data to the staged output, escaping any IAC bytes and optionally translating newlines
+static void _output_escaped(telnet_output_t *output, const uint8_t *data, size_t length, bool nvt) {
+  // Escape straight into the buffer when all of the data fits. Escaping at most doubles the data,
+  // so the escaped length only has to be counted when the room is less than that.
+  size_t room = output->capacity - output->length;
+  if (length <= room / 2 || length + (nvt ? _count_nvt : _count_iac)(data, length) <= room) {
+    size_t consumed;
+    output->length += _escape(data, length, &consumed, &output->buffer[output->length], room, nvt);
+    return;
+  }
+
+  telnet_scan_t scan = nvt ? _find_nvt : _find_iac;
+  size_t i = 0;
+  while (i < length) {
+    size_t run = scan(&data[i], length - i);
+    if (run > 0) {
+      _output_append(output, &data[i], run);
+      i += run;
+    }
+    if (i < length) {
+      uint8_t escape[2];
+      i += _escape_special(data, i, length, escape);
+      _output_append(output, escape, 2);
+    }
+  }
+}
+
+// Start staging output. Sessions with an output buffer stage into it, after anything already held there,
+// and automatic replies that are still held go ahead of the new output.
+static void _output_begin(telnet_output_t *output, telnet_session_t *session, telnet_writer_t writer,
+                          uint8_t *buffer, size_t capacity) {
+  output->session = session;
+  output->writer = writer;
+  output->buffer = buffer;
+  output->capacity = capacity;
+  output->length = 0;
+  if (session->output_buffer != NULL) {
+    output->buffer = session->output_buffer;
+    output->capacity = session->output_capacity;
+    output->length = session->output_length;
+  }
+#if TELNET_REPLY_BUFFER_SIZE >= 3
+  _output_append(output, session->reply_buffer, session->reply_length);
+#endif
+  session->reply_length = 0;
+}
+
+// Finish staging output. With a flush policy, output in the session's buffer is held back
+// until it reaches the size threshold, a prompt is written, or the deadline passes.
+static void _output_end(telnet_output_t *output, bool prompt) {
+  telnet_session_t *session = output->session;
+  const telnet_flush_policy_t *policy = session->flush_policy;
+  bool staged = (output->buffer == session->output_buffer);
+  if (staged && policy != NULL && output->length > 0 &&
+      (policy->size_threshold == 0 || output->length < policy->size_threshold) &&
+      !(prompt && policy->flush_on_prompt)) {
+    if (session->output_length == 0) {
+      session->output_deadline = session->output_clock + policy->max_delay;
+    }
+    session->output_length = output->length;
+    return;
+  }
+  _output_flush(output);
+  if (staged) {
+    session->output_length = 0;
+  }
+}
+
+// Send everything the session is holding back: staged output, then automatic replies
+static void _flush_output(telnet_session_t *session, telnet_writer_t writer) {
+  if (writer == NULL) {
+    session->reply_length = 0;
+    return;
+  }
+  if (session->output_length > 0) {
+    telnet_output_t output;
+    _output_begin(&output, session, writer, NULL, 0);
+    _output_flush(&output);
+    session->output_length = 0;
+  }
+#if TELNET_REPLY_BUFFER_SIZE >= 3
+  else if (session->reply_length > 0) {
+    writer(session, session->reply_buffer, session->reply_length);
+  }
+#endif
+  session->reply_length = 0;
+}
+
+// Send the automatic replies the session is holding, along with any output staged ahead of them
+static void _flush_replies(telnet_session_t *session, telnet_writer_t writer) {
+  if (session->reply_length > 0) {
+    _flush_output(session, writer);
+  }
+}
+
+// NVT newlines are sent unless we have agreed to send binary data
+static bool _translate_output(const telnet_session_t *session) {
+  return session->output_newlines != TELNET_NEWLINE_NONE &&
+         !_option_enabled(&session->local_options, TELNET_OPTION_BINARY);
+}
+
+void telnet_flush(telnet_session_t *session, telnet_writer_t writer) {
+  if (session == NULL) {
+    return;
+  }
+  _flush_output(session, writer);
+}
+
+void telnet_set_flush_policy(telnet_session_t *session, const telnet_flush_policy_t *policy) {
+  if (session == NULL) {
+    return;
+  }
+  session->flush_policy = policy;
+}
+
+void telnet_poll(telnet_session_t *session, uint32_t now, telnet_writer_t writer) {
+  if (session == NULL) {
+    return;
+  }
+  session->output_clock = now;
+  if (session->output_length == 0) {
+    return;
+  }
+  // The clock is allowed to wrap around. A deadline further away than the policy allows
+  // was set before the session knew the time, so it is treated as passed.
+  uint32_t max_delay = (session->flush_policy != NULL) ? session->flush_policy->max_delay : 0;
+  if ((int32_t)(now - session->output_deadline) >= 0 || session->output_deadline - now > max_delay) {
+    _flush_output(session, writer);
+  }
+}
+
+bool telnet_set_output_buffer(telnet_session_t *session, uint8_t *buffer, size_t capacity) {
+  // Switching buffers would lose the output held by a flush policy, so that has to be flushed first
+  if (session == NULL || session->output_length > 0) {
+    return false;
+  }
+  // The buffer must at least hold an escaped IAC
+  bool usable = (buffer != NULL && capacity >= 2);
+  session->output_buffer = usable ? buffer : NULL;
+  session->output_capacity = usable ? capacity : 0;
+  return true;
+}
+
+static void _queue_notify(telnet_session_t *session, telnet_output_event_t event) {
+  if (session->output_queue->callback != NULL) {
+    session->output_queue->callback(session, event);
+  }
+}
+
+static void _queue_check_high(telnet_session_t *session) {
+  telnet_output_queue_t *queue = session->output_queue;
+  if (!queue->above_high_watermark && queue->length >= queue->high_watermark) {
+    queue->above_high_watermark = true;
+    _queue_notify(session, TELNET_OUTPUT_HIGH_WATERMARK);
+  }
+}
+
+// Returns true if the output queue has room for the given number of bytes
+static bool _queue_fits(const telnet_output_queue_t *queue, size_t length) {
+  return length <= queue->capacity - queue->length;
+}
+
+// Add data to the output queue. The caller makes sure it fits.
+static void _queue_append(telnet_session_t *session, const uint8_t *data, size_t length) {
+  telnet_output_queue_t *queue = session->output_queue;
+  size_t tail = (queue->head + queue->length) % queue->capacity;
+  size_t first = (queue->capacity - tail < length) ? queue->capacity - tail : length;
+  memcpy(&queue->storage[tail], data, first);
+  memcpy(queue->storage, &data[first], length - first);
+  queue->length += length;
+}
+
+// Escape as much data as fits into the output queue, returning how much of the data was used
+static size_t _queue_escaped(telnet_session_t *session, const uint8_t *data, size_t length, bool nvt) {
+  telnet_output_queue_t *queue = session->output_queue;
+  size_t capacity = queue->capacity;
+  size_t i = 0;
+  while (i < length && queue->length < capacity) {
+    size_t free = capacity - queue->length;
+    size_t tail = (queue->head + queue->length) % capacity;
+    size_t room = (capacity - tail < free) ? capacity - tail : free;
+    size_t consumed;
+    size_t produced = _escape(&data[i], length - i, &consumed, &queue->storage[tail], room, nvt);
+    queue->length += produced;
+    i += consumed;
+    if (i == length || produced == room) {
+      continue;
+    }
+    // The next byte is escaped and did not fit before the end of the room.
+    // If the room ends at the end of the storage, the escaped byte wraps around to the start.
+    if (tail + room == capacity && free - produced >= 2) {
+      uint8_t escape[2];
+      i += _escape_special(data, i, length, escape);
+      _queue_append(session, escape, 2);
+    } else {
+      break;
+    }
+  }
+  return i;
+}
+
+// Replies are held in the session until the end of the read, so they reach the writer together.
+static void _write_reply(telnet_session_t *session, const uint8_t *reply, size_t length, telnet_writer_t writer) {
+  if (session->output_queue != NULL) {
+    if (!_queue_fits(session->output_queue, length)) {
+      _queue_notify(session, TELNET_OUTPUT_OVERFLOW);
+      return;
+    }
+    _queue_append(session, reply, length);
+    _queue_check_high(session);
+    return;
+  }
+#if TELNET_REPLY_BUFFER_SIZE >= 3
+  if (session->reply_length + length > sizeof(session->reply_buffer)) {
+    _flush_replies(session, writer);
+  }
+  if (length <= sizeof(session->reply_buffer)) {
+    memcpy(&session->reply_buffer[session->reply_length], reply, length);
+    session->reply_length += length;
+    return;
+  }
+#endif
+  // Too long to hold, so everything held goes first to keep the output in order
+  if (writer != NULL) {
+    _flush_output(session, writer);
+    writer(session, reply, length);
+  }
+}
+
+// Subnegotiation replies are held with the other replies when they fit in the reply buffer. A longer one is
+// sent as a packet straight away, rather than being left to the flush policy after the read has ended.
+static void _write_subnegotiation_reply(telnet_session_t *session, telnet_option_t option, const uint8_t *value,
+                                        telnet_writer_t writer) {
+  size_t length = strlen((const char *)value);
+  size_t size = 4 + telnet_escaped_length(value, length) + 2;
+  uint8_t reply[(TELNET_REPLY_BUFFER_SIZE >= 6) ? TELNET_REPLY_BUFFER_SIZE : 6];
+  if (size <= sizeof(reply)) {
+    reply[0] = TELNET_IAC;
+    reply[1] = TELNET_SB;
+    reply[2] = (uint8_t)option;
+    reply[3] = TELNET_SE_IS;
+    telnet_escape(value, length, &reply[4], size - 6);
+    reply[size - 2] = TELNET_IAC;
+    reply[size - 1] = TELNET_SE;
+    _write_reply(session, reply, size, writer);
+    return;
+  }
+
+  telnet_packet_t packet;
+  telnet_init_packet(&packet);
+  packet.command = TELNET_SB;
+  packet.option = option;
+  packet.subnegotiation_type = TELNET_SE_IS;
+  packet.subnegotiation_length = length;
+  packet.subnegotiation_data = value;
+  telnet_write_packet(session, &packet, writer);
+  if (session->output_queue == NULL) {
+    _flush_output(session, writer);
+  }
+}
+
+// Negotiation replies are always three bytes, so they are encoded directly rather than through a packet.
+static void _write_negotiation(telnet_session_t *session, telnet_command_t command, telnet_option_t option,
+                               telnet_writer_t writer) {
+  const uint8_t reply[3] = { TELNET_IAC, command, option };
+  _write_reply(session, reply, sizeof(reply), writer);
+}
+
+static void _queue_packet(telnet_session_t *session, const telnet_packet_t *packet) {
+  uint8_t header[4] = { TELNET_IAC, packet->command, packet->option, packet->subnegotiation_type };
+  static const uint8_t trailer[2] = { TELNET_IAC, TELNET_SE };
+  size_t header_length = 2;
+  size_t size = 2;
+  switch (packet->command) {
+    case TELNET_DO:
+    case TELNET_DONT:
+    case TELNET_WILL:
+    case TELNET_WONT:
+      header_length = 3;
+      size = 3;
+      break;
+    case TELNET_SB:
+      header_length = 4;
+      size = 4 + telnet_escaped_length(packet->subnegotiation_data, packet->subnegotiation_length) + 2;
+      break;
+    default:
+      break;
+  }
+
+  // Packets are queued whole or not at all
+  if (!_queue_fits(session->output_queue, size)) {
+    _queue_notify(session, TELNET_OUTPUT_OVERFLOW);
+    return;
+  }
+  _queue_append(session, header, header_length);
+  if (packet->command == TELNET_SB) {
+    if (packet->subnegotiation_data != NULL) {
+      _queue_escaped(session, packet->subnegotiation_data, packet->subnegotiation_length, false);
+    }
+    _queue_append(session, trailer, 2);
+  }
+  _queue_check_high(session);
+}
+
+void telnet_set_output_queue(telnet_session_t *session, telnet_output_queue_t *queue, uint8_t *storage,
+                             size_t capacity, size_t low_watermark, size_t high_watermark,
+                             telnet_output_callback_t callback) {
+  if (session == NULL) {
+    return;
+  }
+  // The queue must at least hold an escaped IAC
+  if (queue == NULL || storage == NULL || capacity < 2) {
+    session->output_queue = NULL;
+    return;
+  }
+  queue->storage = storage;
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->length = 0;
+  queue->low_watermark = low_watermark;
+  queue->high_watermark = high_watermark;
+  queue->above_high_watermark = false;
+  queue->callback = callback;
+  session->output_queue = queue;
+}
+
+size_t telnet_output_queued(const telnet_session_t *session) {
+  if (session == NULL || session->output_queue == NULL) {
+    return 0;
+  }
+  return session->output_queue->length;
+}
+
+size_t telnet_flush_output(telnet_session_t *session, telnet_output_writer_t writer) {
+  if (session == NULL || session->output_queue == NULL) {
+    return 0;
+  }
+  telnet_output_queue_t *queue = session->output_queue;
+
+  // Send the queue in at most two pieces, stopping as soon as the writer takes less than it was given
+  while (writer != NULL && queue->length > 0) {
+    size_t chunk = queue->capacity - queue->head;
+    if (chunk > queue->length) {
+      chunk = queue->length;
+    }
+    size_t sent = writer(session, &queue->storage[queue->head], chunk);
+    if (sent > chunk) {
+      sent = chunk;
+    }
+    queue->head = (queue->head + sent) % queue->capacity;
+    queue->length -= sent;
+    if (sent < chunk) {
+      break;
+    }
+  }
+  if (queue->length == 0) {
+    queue->head = 0;
+  }
+
+  if (queue->above_high_watermark && queue->length <= queue->low_watermark) {
+    queue->above_high_watermark = false;
+    _queue_notify(session, TELNET_OUTPUT_LOW_WATERMARK);
+  }
+  return queue->length;
+}
+
+size_t telnet_write(telnet_session_t *session, const uint8_t *data, size_t length, telnet_writer_t writer) {
+  if (session == NULL || data == NULL || length == 0) {
+    return 0;
+  }
+  if (session->output_queue != NULL) {
+    size_t consumed = _queue_escaped(session, data, length, _translate_output(session));
+    if (consumed < length) {
+      _queue_notify(session, TELNET_OUTPUT_OVERFLOW);
+    }
+    _queue_check_high(session);
+    return consumed;
+  }
+  if (writer == NULL) {
+    return 0;
+  }
+
+  // Escape the data into the session's output buffer, or a small buffer on the stack,
+  // so the writer is called once for anything that fits in the buffer
+  uint8_t buffer[TELNET_WRITE_BUFFER_SIZE];
+  telnet_output_t output;
+  _output_begin(&output, session, writer, buffer, sizeof(buffer));
+  _output_escaped(&output, data, length, _translate_output(session));
+  _output_end(&output, false);
+  return length;
+}
+
+void telnet_write_packet(telnet_session_t *session, const telnet_packet_t *packet, telnet_writer_t writer) {
+  if (session == NULL || packet == NULL) {
+    return;
+  }
+  if (session->output_queue != NULL) {
+    _queue_packet(session, packet);
+    return;
+  }
+  if (writer == NULL) {
+    return;
+  }
+
+  uint8_t buffer[TELNET_WRITE_BUFFER_SIZE];
+  telnet_output_t output;
+  _output_begin(&output, session, writer, buffer, sizeof(buffer));
+
+  // Start with IAC (Interpret As Command)
+  uint8_t header[4] = { TELNET_IAC, packet->command, packet->option, packet->subnegotiation_type };
+  switch(packet->command) {
+    case TELNET_DO:
+    case TELNET_DONT:
+    case TELNET_WILL:
+    case TELNET_WONT:
+    _output_append(&output, header, 3);
+    break;
+    case TELNET_SB:
+    _output_append(&output, header, 4);
+    if (packet->subnegotiation_data != NULL) {
+      _output_escaped(&output, packet->subnegotiation_data, packet->subnegotiation_length, false);
+    }
+    header[1] = TELNET_SE; // Subnegotiation end
+    _output_append(&output, header, 2);
+    break;
+    default:
+    // For other commands, we just send the command byte
+    _output_append(&output, header, 2);
+    break;
+  }
+
+  // Prompts can flush output that is being held back
+  _output_end(&output, packet->command == TELNET_GA || packet->command == TELNET_EOR);
+}
+
+bool telnet_request_option(telnet_session_t *session, telnet_command_t command, telnet_option_t option,
+                           telnet_writer_t writer) {
+  if (session == NULL || option < 0 || option > 255) {
+    return false;
+  }
+
+  telnet_option_state_t *side;
+  bool enable;
+  switch (command) {
+    case TELNET_WILL: side = &session->local_options; enable = true; break;
+    case TELNET_WONT: side = &session->local_options; enable = false; break;
+    case TELNET_DO: side = &session->remote_options; enable = true; break;
+    case TELNET_DONT: side = &session->remote_options; enable = false; break;
+    default: return false;
+  }
+
+  bool yes = _bit_get(side->yes, option);
+  if (_bit_get(side->pending, option)) {
+    // A negotiation is in progress, so queue the request (or cancel a queued one) until the peer answers.
+    // WANTNO is heading for disabled and WANTYES for enabled, the opposite bit reverses that.
+    if (enable == yes) {
+      _bit_set(side->opposite, option);
+    } else {
+      _bit_clear(side->opposite, option);
+    }
+    return true;
+  }
+  if (enable == yes) {
+    return true;
+  }
+
+  // NO becomes WANTYES and YES becomes WANTNO once the request is on its way
+  uint8_t request[3] = { TELNET_IAC, (uint8_t)command, (uint8_t)option };
+  if (!_write_encoded(session, request, sizeof(request), writer)) {
+    return false;
+  }
+  _bit_set(side->pending, option);
+  return true;
+}
+
+bool telnet_local_option_enabled(const telnet_session_t *session, telnet_option_t option) {
+  if (session == NULL) {
+    return false;
+  }
+  return _option_enabled(&session->local_options, option);
+}
+
+bool telnet_remote_option_enabled(const telnet_session_t *session, telnet_option_t option) {
+  if (session == NULL) {
+    return false;
+  }
+  return _option_enabled(&session->remote_options, option);
+}
+
+size_t telnet_escaped_length(const uint8_t *data, size_t length) {
+  if (data == NULL) {
+    return 0;
+  }
+  return length + _count_iac(data, length);
+}
+
+size_t telnet_escape(const uint8_t *data, size_t length, uint8_t *output, size_t capacity) {
+  if (data == NULL || output == NULL) {
+    return 0;
+  }
+
+  size_t escaped_length = telnet_escaped_length(data, length);
+  if (escaped_length > capacity) {
+    return 0;
+  }
+  if (escaped_length == length) {
+    memcpy(output, data, length);
+    return length;
+  }
+  size_t consumed;
+  return _escape(data, length, &consumed, output, capacity, false);
+}
+
+size_t telnet_write_to_buffer(const uint8_t *data, size_t length, uint8_t *output, size_t capacity, size_t *consumed) {
+  size_t used = 0;
+  size_t produced = 0;
+  // A buffer must at least hold an escaped IAC, so every call with data makes progress
+  if (data != NULL && output != NULL && capacity >= 2) {
+    produced = _escape(data, length, &used, output, capacity, false);
+  }
+  if (consumed != NULL) {
+    *consumed = used;
+  }
+  return produced;
+}
+
+// With a flush policy, data the policy would hold back is escaped into the output buffer instead of being sent,
+// so `telnet_writev` holds small writes just like `telnet_write`. Returns false if the data has to be sent now.
+static bool _hold_writev(telnet_session_t *session, const uint8_t *data, size_t length, bool nvt) {
+  const telnet_flush_policy_t *policy = session->flush_policy;
+  if (policy == NULL || session->output_buffer == NULL) {
+    return false;
+  }
+  size_t size = session->output_length + session->reply_length + length + (nvt ? _count_nvt : _count_iac)(data, length);
+  if (size > session->output_capacity || (policy->size_threshold != 0 && size >= policy->size_threshold)) {
+    return false;
+  }
+  // Everything fits, so staging never calls the writer
+  telnet_output_t output;
+  _output_begin(&output, session, NULL, NULL, 0);
+  _output_escaped(&output, data, length, nvt);
+  _output_end(&output, false);
+  return true;
+}
+
+// Add a segment to a vector write, leaving out empty ones
+static void _add_segment(telnet_iovec_t *segments, size_t *count, const uint8_t *data, size_t length) {
+  if (length > 0) {
+    segments[*count].data = data;
+    segments[*count].length = length;
+    (*count)++;
+  }
+}
+
+size_t telnet_writev(telnet_session_t *session, const uint8_t *data, size_t length, telnet_vector_writer_t writer) {
+  if (session == NULL || data == NULL || length == 0) {
+    return 0;
+  }
+  bool nvt = _translate_output(session);
+  if (session->output_queue != NULL) {
+    // Queued output is copied into the queue, behind whatever is already waiting there
+    size_t consumed = _queue_escaped(session, data, length, nvt);
+    if (consumed < length) {
+      _queue_notify(session, TELNET_OUTPUT_OVERFLOW);
+    }
+    _queue_check_high(session);
+    return consumed;
+  }
+  if (writer == NULL) {
+    return 0;
+  }
+  if (_hold_writev(session, data, length, nvt)) {
+    return length;
+  }
+
+  static const uint8_t cr = '\r';
+  static const uint8_t nul = '\0';
+  telnet_scan_t scan = nvt ? _find_nvt : _find_iac;
+  telnet_iovec_t segments[TELNET_WRITEV_SEGMENTS];
+  size_t count = 0;
+  // Output and replies that are still held go first
+  if (session->output_length > 0) {
+    segments[count].data = session->output_buffer;
+    segments[count].length = session->output_length;
+    count++;
+    session->output_length = 0;
+  }
+#if TELNET_REPLY_BUFFER_SIZE >= 3
+  if (session->reply_length > 0) {
+    segments[count].data = session->reply_buffer;
+    segments[count].length = session->reply_length;
+    count++;
+    session->reply_length = 0;
+  }
+#endif
+  size_t start = 0;
+  size_t i = 0;
+  while (i < length) {
+    i += scan(&data[i], length - i);
+    if (i == length) {
+      break;
+    }
+    uint8_t c = data[i];
+    if (_is_crlf(data, i, length)) {
+      // CR LF is already an NVT newline and stays in the segment
+      i += 2;
+      continue;
+    }
+    if (count + ((c == TELNET_IAC) ? 1 : 2) > TELNET_WRITEV_SEGMENTS) {
+      writer(session, segments, count);
+      count = 0;
+    }
+    if (c == TELNET_IAC) {
+      // End the segment after the IAC and start the next one on it, which escapes it
+      _add_segment(segments, &count, &data[start], i + 1 - start);
+      start = i;
+    } else if (c == '\r') {
+      // End the segment after a bare CR and follow it with a NUL
+      _add_segment(segments, &count, &data[start], i + 1 - start);
+      _add_segment(segments, &count, &nul, 1);
+      start = i + 1;
+    } else {
+      // End the segment before a bare LF, which is empty when the LF comes first, and put a CR in front of it
+      _add_segment(segments, &count, &data[start], i - start);
+      _add_segment(segments, &count, &cr, 1);
+      start = i;
+    }
+    i++;
+  }
+  if (start < length) {
+    if (count == TELNET_WRITEV_SEGMENTS) {
+      writer(session, segments, count);
+      count = 0;
+    }
+    _add_segment(segments, &count, &data[start], length - start);
+  }
+  writer(session, segments, count);
+  return length;
+}
+
+// Send data that has already been encoded for the session
+static bool _write_encoded(telnet_session_t *session, const uint8_t *data, size_t length, telnet_writer_t writer) {
+  if (session->output_queue != NULL) {
+    if (!_queue_fits(session->output_queue, length)) {
+      _queue_notify(session, TELNET_OUTPUT_OVERFLOW);
+      return false;
+    }
+    _queue_append(session, data, length);
+    _queue_check_high(session);
+    return true;
+  }
+  if (writer == NULL) {
+    return false;
+  }
+  if (session->flush_policy != NULL && session->output_buffer != NULL) {
+    telnet_output_t output;
+    _output_begin(&output, session, writer, NULL, 0);
+    _output_append(&output, data, length);
+    _output_end(&output, false);
+    return true;
+  }
+  _flush_output(session, writer);
+  writer(session, data, length);
+  return true;
+}
+
+bool telnet_script_init(telnet_negotiation_script_t *script, const telnet_negotiation_t *requests, size_t count,
+                        uint8_t *buffer, size_t capacity) {
+  if (script == NULL || (count > 0 && (requests == NULL || buffer == NULL)) || count > capacity / 3) {
+    return false;
+  }
+
+  // Requesting an option twice would send it twice, so duplicates are refused
+  uint32_t will_seen[TELNET_OPTION_WORDS] = {0};
+  uint32_t do_seen[TELNET_OPTION_WORDS] = {0};
+  memset(script->queries, 0, sizeof(script->queries));
+  for (size_t i = 0; i < count; i++) {
+    uint32_t *seen;
+    switch (requests[i].command) {
+      case TELNET_WILL: seen = will_seen; break;
+      case TELNET_DO: seen = do_seen; break;
+      default: return false;
+    }
+    if (requests[i].option < 0 || requests[i].option > 255 || _bit_get(seen, requests[i].option)) {
+      return false;
+    }
+    _bit_set(seen, requests[i].option);
+    buffer[3 * i] = TELNET_IAC;
+    buffer[3 * i + 1] = (uint8_t)requests[i].command;
+    buffer[3 * i + 2] = (uint8_t)requests[i].option;
+    if (requests[i].query && requests[i].command == TELNET_DO) {
+      _bit_set(script->queries, requests[i].option);
+    }
+  }
+  script->requests = requests;
+  script->count = count;
+  script->encoded = buffer;
+  script->length = 3 * count;
+  return true;
+}
+
+bool telnet_start_negotiation(telnet_session_t *session, const telnet_negotiation_script_t *script,
+                              telnet_writer_t writer) {
+  if (session == NULL || script == NULL) {
+    return false;
+  }
+  session->negotiation_script = script;
+
+  // A fresh session has every option in the NO state, so the encoded script is exactly what RFC 1143 would send
+  bool fresh = true;
+  for (size_t i = 0; i < script->count && fresh; i++) {
+    const telnet_negotiation_t *request = &script->requests[i];
+    telnet_option_state_t *side = (request->command == TELNET_WILL) ? &session->local_options
+                                                                     : &session->remote_options;
+    fresh = !_bit_get(side->yes, request->option) && !_bit_get(side->pending, request->option);
+  }
+  if (!fresh) {
+    bool sent = true;
+    for (size_t i = 0; i < script->count; i++) {
+      sent = telnet_request_option(session, script->requests[i].command, script->requests[i].option, writer) && sent;
+    }
+    return sent;
+  }
+  if (script->length == 0) {
+    return true;
+  }
+  if (!_write_encoded(session, script->encoded, script->length, writer)) {
+    return false;
+  }
+
+  // NO becomes WANTYES for every request now that they are on their way
+  for (size_t i = 0; i < script->count; i++) {
+    const telnet_negotiation_t *request = &script->requests[i];
+    telnet_option_state_t *side = (request->command == TELNET_WILL) ? &session->local_options
+                                                                     : &session->remote_options;
+    _bit_set(side->pending, request->option);
+  }
+  return true;
+}
+
+size_t telnet_broadcast(telnet_session_t *const *sessions, size_t count, const uint8_t *data, size_t length,
+                        uint8_t *buffer, size_t capacity, telnet_writer_t writer) {
+  if (sessions == NULL || data == NULL || length == 0) {
+    return 0;
+  }
+
+  // The data is encoded at most once for each output mode, the first time a session needs it
+  const uint8_t *encoded[2] = { NULL, NULL };
+  size_t encoded_length[2] = { 0, 0 };
+  bool shared[2] = { true, true };
+  size_t used = 0;
+  size_t delivered = 0;
+  for (size_t i = 0; i < count; i++) {
+    telnet_session_t *session = sessions[i];
+    if (session == NULL) {
+      continue;
+    }
+    int mode = _translate_output(session) ? 1 : 0;
+    if (encoded[mode] == NULL && shared[mode]) {
+      size_t size = length + (mode ? _count_nvt : _count_iac)(data, length);
+      if (buffer != NULL && size <= capacity - used) {
+        size_t consumed;
+        encoded[mode] = &buffer[used];
+        encoded_length[mode] = _escape(data, length, &consumed, &buffer[used], size, mode);
+        used += size;
+      } else {
+        shared[mode] = false;
+      }
+    }
+    if (encoded[mode] != NULL) {
+      delivered += _write_encoded(session, encoded[mode], encoded_length[mode], writer);
+    } else if (session->output_queue != NULL &&
+               !_queue_fits(session->output_queue, telnet_write_length(session, data, length))) {
+      // A queue gets the whole message or none of it, as with a shared copy
+      _queue_notify(session, TELNET_OUTPUT_OVERFLOW);
+    } else {
+      // Without room for a shared copy, each session encodes the data itself
+      delivered += (telnet_write(session, data, length, writer) == length);
+    }
+  }
+  return delivered;
+}
+
+size_t telnet_write_length(const telnet_session_t *session, const uint8_t *data, size_t length) {
+  if (session == NULL || data == NULL) {
+    return 0;
+  }
+  return length + (_translate_output(session) ? _count_nvt : _count_iac)(data, length);
+}
+
+// Checkpoints start with a magic number and a format version
+#define _CHECKPOINT_MAGIC_0 'T'
+#define _CHECKPOINT_MAGIC_1 'S'
+#define _CHECKPOINT_VERSION 5
+
+// Fixed size part of a checkpoint: magic, version, state, command, option, subnegotiation type,
+// subnegotiation length, flags, input and output newlines and the number of subnegotiation options.
+// The local and remote supported options and option state follow, as 8 option sets.
+#define _CHECKPOINT_HEADER_SIZE (2 + 1 + 1 + 1 + 1 + 1 + 4 + 4 + 1 + 1 + 1)
+
+// Smallest checkpoint, with every option set empty
+#define _CHECKPOINT_MIN_SIZE (_CHECKPOINT_HEADER_SIZE + 8)
+
+static uint8_t *_put_uint(uint8_t *out, uint64_t value, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    *out++ = (uint8_t)(value >> (8 * i));
+  }
+  return out;
+}
+
+static uint64_t _get_uint(const uint8_t *in, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+// Option sets are mostly empty, so a set is stored as a byte with one bit for each word that has options in it,
+// followed by only those words. The few options a session usually uses take 1 to 9 bytes instead of 32.
+static size_t _option_set_size(const uint32_t *bits) {
+  size_t size = 1;
+  for (size_t i = 0; i < TELNET_OPTION_WORDS; i++) {
+    size += (bits[i] != 0) ? 4 : 0;
+  }
+  return size;
+}
+
+static uint8_t *_put_option_set(uint8_t *out, const uint32_t *bits) {
+  uint8_t *words = out++;
+  *words = 0;
+  for (size_t i = 0; i < TELNET_OPTION_WORDS; i++) {
+    if (bits[i] != 0) {
+      *words |= (uint8_t)(1u << i);
+      out = _put_uint(out, bits[i], 4);
+    }
+  }
+  return out;
+}
+
+// Returns NULL if the set runs past the end of the checkpoint
+static const uint8_t *_get_option_set(const uint8_t *in, const uint8_t *end, uint32_t *bits) {
+  if (in == NULL || in >= end) {
+    return NULL;
+  }
+  uint8_t words = *in++;
+  for (size_t i = 0; i < TELNET_OPTION_WORDS; i++) {
+    bits[i] = 0;
+    if (words & (1u << i)) {
+      if (end - in < 4) {
+        return NULL;
+      }
+      bits[i] = (uint32_t)_get_uint(in, 4);
+      in += 4;
+    }
+  }
+  return in;
+}
+
+static size_t _option_state_size(const telnet_option_state_t *state) {
+  return _option_set_size(state->yes) + _option_set_size(state->pending) + _option_set_size(state->opposite);
+}
+
+static uint8_t *_put_option_state(uint8_t *out, const telnet_option_state_t *state) {
+  out = _put_option_set(out, state->yes);
+  out = _put_option_set(out, state->pending);
+  return _put_option_set(out, state->opposite);
+}
+
+static const uint8_t *_get_option_state(const uint8_t *in, const uint8_t *end, telnet_option_state_t *state) {
+  in = _get_option_set(in, end, state->yes);
+  in = _get_option_set(in, end, state->pending);
+  return _get_option_set(in, end, state->opposite);
+}
+
+// Returns true if the subnegotiation currently being received is collected in the session
+static bool _collecting_subnegotiation(const telnet_session_t *session) {
+  return session->subnegotiation_stream == NULL &&
+         (session->state == TELNET_STATE_IN_SUBNEGOTIATION_VALUE || session->state == TELNET_STATE_IN_SB_IAC);
+}
+
+size_t telnet_checkpoint(telnet_session_t *session, uint8_t *buffer, size_t capacity) {
+  if (session == NULL) {
+    return 0;
+  }
+
+  size_t subnegotiation_capacity;
+  const uint8_t *subnegotiation = _subnegotiation_buffer(session, &subnegotiation_capacity);
+  size_t subnegotiation_length = _collecting_subnegotiation(session) ? session->packet.subnegotiation_length : 0;
+
+  // Work out the size first, so we never write a partial checkpoint
+  const telnet_profile_t *profile = session->profile;
+  size_t size = _CHECKPOINT_HEADER_SIZE + subnegotiation_length;
+  size += _option_set_size(profile->local_supported) + _option_set_size(profile->remote_supported);
+  size += _option_state_size(&session->local_options) + _option_state_size(&session->remote_options);
+  size_t option_count = 0;
+  for (size_t i = 0; i < TELNET_MAX_OPTIONS; i++) {
+    if (profile->subnegotiation_options[i] != NULL) {
+      size += 1 + 2 + strlen((const char *)profile->subnegotiation_options[i]);
+      option_count++;
+    }
+  }
+  if (buffer == NULL || capacity < size) {
+    return (buffer == NULL) ? size : 0;
+  }
+
+  uint8_t *out = buffer;
+  *out++ = _CHECKPOINT_MAGIC_0;
+  *out++ = _CHECKPOINT_MAGIC_1;
+  *out++ = _CHECKPOINT_VERSION;
+  *out++ = (uint8_t)session->state;
+  *out++ = (uint8_t)session->packet.command;
+  *out++ = (uint8_t)session->packet.option;
+  *out++ = (uint8_t)session->packet.subnegotiation_type;
+  out = _put_uint(out, subnegotiation_length, 4);
+  out = _put_uint(out, session->flags & _PROTOCOL_FLAGS, 4);
+  *out++ = (uint8_t)session->input_newlines;
+  *out++ = (uint8_t)session->output_newlines;
+  *out++ = (uint8_t)option_count;
+  out = _put_option_set(out, profile->local_supported);
+  out = _put_option_set(out, profile->remote_supported);
+  out = _put_option_state(out, &session->local_options);
+  out = _put_option_state(out, &session->remote_options);
+  if (subnegotiation_length > 0) {
+    memcpy(out, subnegotiation, subnegotiation_length);
+    out += subnegotiation_length;
+  }
+  for (size_t i = 0; i < TELNET_MAX_OPTIONS; i++) {
+    if (profile->subnegotiation_options[i] != NULL) {
+      size_t length = strlen((const char *)profile->subnegotiation_options[i]);
+      *out++ = (uint8_t)i;
+      out = _put_uint(out, length, 2);
+      memcpy(out, profile->subnegotiation_options[i], length);
+      out += length;
+    }
+  }
+  return size;
+}
+
+bool telnet_restore(telnet_session_t *session, const uint8_t *data, size_t length, telnet_arena_t *arena) {
+  if (session == NULL || data == NULL || length < _CHECKPOINT_MIN_SIZE) {
+    return false;
+  }
+  if (data[0] != _CHECKPOINT_MAGIC_0 || data[1] != _CHECKPOINT_MAGIC_1 || data[2] != _CHECKPOINT_VERSION ||
+      data[3] > TELNET_STATE_IN_SUBNEGOTIATION_OPTION) {
+    return false;
+  }
+
+  const uint8_t *in = data + 7;
+  size_t subnegotiation_length = (size_t)_get_uint(in, 4);
+  in += 4;
+  uint32_t flags = (uint32_t)_get_uint(in, 4);
+  in += 4;
+  telnet_newline_t input_newlines = *in++;
+  telnet_newline_t output_newlines = *in++;
+  size_t option_count = *in++;
+  const uint8_t *end = data + length;
+  uint32_t local_supported[TELNET_OPTION_WORDS];
+  in = _get_option_set(in, end, local_supported);
+  uint32_t remote_supported[TELNET_OPTION_WORDS];
+  in = _get_option_set(in, end, remote_supported);
+  telnet_option_state_t local_options;
+  in = _get_option_state(in, end, &local_options);
+  telnet_option_state_t remote_options;
+  in = _get_option_state(in, end, &remote_options);
+  if (in == NULL || subnegotiation_length > (size_t)(end - in)) {
+    return false;
+  }
+  const uint8_t *subnegotiation = in;
+  in += subnegotiation_length;
+
+  // Check the subnegotiation options before changing anything, and whether the session's profile already
+  // matches the checkpoint, as it does when a shared profile was set up before restoring
+  const telnet_profile_t *current = session->profile;
+  bool same = memcmp(current->local_supported, local_supported, sizeof(local_supported)) == 0 &&
+              memcmp(current->remote_supported, remote_supported, sizeof(remote_supported)) == 0;
+  size_t current_count = 0;
+  for (size_t i = 0; i < TELNET_MAX_OPTIONS; i++) {
+    current_count += (current->subnegotiation_options[i] != NULL);
+  }
+  same = same && current_count == option_count;
+  const uint8_t *first_option = in;
+  size_t storage = 0;
+  uint32_t seen[TELNET_OPTION_WORDS] = { 0 };
+  for (size_t i = 0; i < option_count; i++) {
+    // Each option may only be listed once, a checkpoint that repeats one is not valid
+    if (end - in < 3 || in[0] >= TELNET_MAX_OPTIONS || _bit_get(seen, in[0])) {
+      return false;
+    }
+    _bit_set(seen, in[0]);
+    const uint8_t *value = current->subnegotiation_options[in[0]];
+    size_t option_length = (size_t)_get_uint(in + 1, 2);
+    in += 3;
+    if (option_length > (size_t)(end - in)) {
+      return false;
+    }
+    same = same && value != NULL && strlen((const char *)value) == option_length &&
+           memcmp(value, in, option_length) == 0;
+    in += option_length;
+    storage += option_length + 1;
+  }
+
+  // Otherwise the options are copied into the session's own profile, with the strings in the arena.
+  // Copying the current profile changes nothing the session can see, so it is done before taking arena space.
+  telnet_profile_t *profile = NULL;
+  uint8_t *strings = NULL;
+  if (!same) {
+    profile = _writable_profile(session);
+    if (profile == NULL) {
+      return false;
+    }
+    if (option_count > 0) {
+      strings = (uint8_t *)telnet_arena_alloc(arena, storage);
+      if (strings == NULL) {
+        return false;
+      }
+    }
+  }
+
+  session->state = data[3];
+  session->packet.command = data[4];
+  session->packet.option = data[5];
+  session->packet.subnegotiation_type = data[6];
+  session->packet.subnegotiation_data = NULL;
+  session->local_options = local_options;
+  session->remote_options = remote_options;
+  session->flags = (flags & _PROTOCOL_FLAGS) | (session->flags & ~(uint32_t)_PROTOCOL_FLAGS);
+  session->input_newlines = input_newlines;
+  session->output_newlines = output_newlines;
+
+  // The partial subnegotiation goes back into whichever buffer the session has now
+  size_t capacity;
+  uint8_t *buffer = _subnegotiation_buffer(session, &capacity);
+  session->packet.subnegotiation_length = (subnegotiation_length < capacity) ? subnegotiation_length : capacity;
+  if (session->packet.subnegotiation_length > 0) {
+    memcpy(buffer, subnegotiation, session->packet.subnegotiation_length);
+  }
+
+  if (profile != NULL) {
+    memcpy(profile->local_supported, local_supported, sizeof(local_supported));
+    memcpy(profile->remote_supported, remote_supported, sizeof(remote_supported));
+    memset(profile->subnegotiation_options, 0, sizeof(profile->subnegotiation_options));
+    in = first_option;
+    for (size_t i = 0; i < option_count; i++) {
+      size_t option_length = (size_t)_get_uint(in + 1, 2);
+      memcpy(strings, in + 3, option_length);
+      strings[option_length] = 0;
+      profile->subnegotiation_options[in[0]] = strings;
+      strings += option_length + 1;
+      in += 3 + option_length;
+    }
+  }
+  return true;
 }
 
 const char *telnet_command_name(uint8_t command) {
@@ -368,6 +2612,7 @@ const char *telnet_command_name(uint8_t command) {
     case TELNET_DM: return "DM";
     case TELNET_NOP: return "NOP";
     case TELNET_SE: return "SE";
+    case TELNET_EOR: return "EOR";
     default: return "UNKNOWN";
   }
 }
@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// A minimal set of checks shared by the tests, so they build anywhere the library does without a test framework.
+// Each test is a small program that prints the checks that failed and exits with a non-zero status if there were any.
+
+#ifndef EMBEDDED_TELNET_TEST_H
+#define EMBEDDED_TELNET_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int test_failures = 0;
+
+#define CHECK(condition)                                               \
+  do {                                                                 \
+    if (!(condition)) {                                                \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      test_failures++;                                                 \
+    }                                                                  \
+  } while (0)
+
+// Compare two byte strings and print both when they differ
+#define CHECK_BYTES(actual, actual_length, expected, expected_length)                                    \
+  do {                                                                                                   \
+    if (!test_bytes_equal((actual), (actual_length), (expected), (expected_length))) {                 \
+      printf("%s:%d: bytes differ: %s\n", __FILE__, __LINE__, #actual);                                \
+      test_print_bytes("  actual:  ", (actual), (actual_length));                                      \
+      test_print_bytes("  expected:", (expected), (expected_length));                                  \
+      test_failures++;                                                                                   \
+    }                                                                                                    \
+  } while (0)
+
+static inline int test_bytes_equal(const void *actual, size_t actual_length, const void *expected, size_t expected_length) {
+  return actual_length == expected_length && (actual_length == 0 || memcmp(actual, expected, actual_length) == 0);
+}
+
+static inline void test_print_bytes(const char *label, const void *data, size_t length) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  printf("%s", label);
+  for (size_t i = 0; i < length && i < 64; i++) {
+    printf(" %02x", bytes[i]);
+  }
+  printf("%s\n", (length > 64) ? " ..." : "");
+}
+
+// A small deterministic generator, so failures can be reproduced on any platform
+static unsigned long test_random_state = 1;
+
+static inline unsigned test_random(unsigned limit) {
+  test_random_state = test_random_state * 1103515245UL + 12345UL;
+  return (unsigned)((test_random_state >> 16) & 0x7FFF) % limit;
+}
+
+static inline int test_result(const char *name) {
+  if (test_failures == 0) {
+    printf("%s: all checks passed\n", name);
+    return EXIT_SUCCESS;
+  }
+  printf("%s: %d checks failed\n", name, test_failures);
+  return EXIT_FAILURE;
+}
+
+#endif
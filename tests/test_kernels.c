@@ -0,0 +1,317 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// Every scanning kernel the CPU can run is checked against a byte at a time reference, and every way of
+// writing escaped data is checked against a byte at a time encoder. The library source is included directly
+// so the kernels, which are static, can be called one by one.
+
+#include "../src/EmbeddedTelnet.c"
+#include "test.h"
+
+#define DATA_SIZE 600
+
+static const char *kernel_names[4] = { "swar", "sse2", "avx2", "avx512" };
+
+// Whether the kernel at this index in `_KERNELS` can run here
+static bool kernel_supported(int kernel) {
+#ifdef TELNET_X86_SIMD
+  __builtin_cpu_init();
+  switch (kernel) {
+    case 1: return __builtin_cpu_supports("sse2");
+    case 2: return __builtin_cpu_supports("avx2");
+    case 3: return __builtin_cpu_supports("avx512bw");
+    default: return true;
+  }
+#else
+  return kernel == 0;
+#endif
+}
+
+// Escape data a byte at a time, optionally with NVT newlines
+static size_t reference_escape(const uint8_t *data, size_t length, uint8_t *output, bool nvt) {
+  size_t out = 0;
+  for (size_t i = 0; i < length; i++) {
+    uint8_t c = data[i];
+    if (c == TELNET_IAC) {
+      output[out++] = TELNET_IAC;
+      output[out++] = TELNET_IAC;
+    } else if (nvt && c == '\r' && i + 1 < length && data[i + 1] == '\n') {
+      output[out++] = '\r';
+      output[out++] = '\n';
+      i++;
+    } else if (nvt && c == '\r') {
+      output[out++] = '\r';
+      output[out++] = '\0';
+    } else if (nvt && c == '\n') {
+      output[out++] = '\r';
+      output[out++] = '\n';
+    } else {
+      output[out++] = c;
+    }
+  }
+  return out;
+}
+
+static size_t reference_find(const uint8_t *data, size_t length, bool nvt) {
+  for (size_t i = 0; i < length; i++) {
+    if (data[i] == TELNET_IAC || (nvt && (data[i] == '\r' || data[i] == '\n'))) {
+      return i;
+    }
+  }
+  return length;
+}
+
+// Random data with a mix of special bytes at the given density in percent
+static void random_data(uint8_t *data, size_t length, unsigned density) {
+  static const uint8_t special[] = { TELNET_IAC, '\r', '\n', '\0' };
+  for (size_t i = 0; i < length; i++) {
+    data[i] = (test_random(100) < density) ? special[test_random(sizeof(special))] : (uint8_t)('a' + test_random(26));
+  }
+}
+
+static void test_kernels(void) {
+  static const telnet_scan_t find_iac[4] = _KERNELS(_find_iac);
+  static const telnet_scan_t count_iac[4] = _KERNELS(_count_iac);
+  static const telnet_scan_t find_nvt[4] = _KERNELS(_find_nvt);
+  static const telnet_scan_t count_nvt[4] = _KERNELS(_count_nvt);
+  static const unsigned densities[] = { 0, 1, 10, 50, 100 };
+  static uint8_t buffer[DATA_SIZE + 64];
+  static uint8_t escaped[2 * DATA_SIZE + 64];
+
+  for (int round = 0; round < 4000 && test_failures == 0; round++) {
+    // Vary the length and alignment so every kernel hits its tail handling and block boundaries
+    size_t offset = test_random(64);
+    size_t length = test_random(DATA_SIZE);
+    uint8_t *data = &buffer[offset];
+    random_data(data, length, densities[round % 5]);
+    size_t iac_length = reference_escape(data, length, escaped, false);
+    size_t nvt_length = reference_escape(data, length, escaped, true);
+
+    for (int kernel = 0; kernel < 4; kernel++) {
+      if (!kernel_supported(kernel)) {
+        continue;
+      }
+      size_t found_iac = find_iac[kernel](data, length);
+      size_t found_nvt = find_nvt[kernel](data, length);
+      size_t counted_iac = count_iac[kernel](data, length);
+      size_t counted_nvt = count_nvt[kernel](data, length);
+      if (found_iac != reference_find(data, length, false) || found_nvt != reference_find(data, length, true) ||
+          length + counted_iac != iac_length || length + counted_nvt != nvt_length) {
+        printf("%s kernel disagrees with the reference, length %zu offset %zu\n", kernel_names[kernel], length, offset);
+        test_failures++;
+      }
+    }
+  }
+}
+
+// The kernels in use were chosen before main, and are the widest ones the CPU can run
+static void test_selected_kernels(void) {
+  static const telnet_scan_t find_iac[4] = _KERNELS(_find_iac);
+  static const telnet_scan_t count_iac[4] = _KERNELS(_count_iac);
+  static const telnet_scan_t find_nvt[4] = _KERNELS(_find_nvt);
+  static const telnet_scan_t count_nvt[4] = _KERNELS(_count_nvt);
+  int widest = 0;
+  for (int kernel = 1; kernel < 4; kernel++) {
+    if (kernel_supported(kernel)) {
+      widest = kernel;
+    }
+  }
+  CHECK(_find_iac == find_iac[widest] && _count_iac == count_iac[widest]);
+  CHECK(_find_nvt == find_nvt[widest] && _count_nvt == count_nvt[widest]);
+}
+
+static uint8_t written[4 * DATA_SIZE];
+static size_t written_length;
+
+static void collect(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  memcpy(&written[written_length], data, length);
+  written_length += length;
+}
+
+static void collect_segments(telnet_session_t *session, const telnet_iovec_t *segments, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    CHECK(segments[i].length > 0);
+    collect(session, segments[i].data, segments[i].length);
+  }
+}
+
+static size_t collect_queued(telnet_session_t *session, const uint8_t *data, size_t length) {
+  // Take a little less than offered now and then, as a slow socket would
+  size_t accepted = (length > 1 && test_random(3) == 0) ? length / 2 : length;
+  collect(session, data, accepted);
+  return accepted;
+}
+
+static void test_writes(void) {
+  static uint8_t data[DATA_SIZE];
+  static uint8_t expected[2 * DATA_SIZE];
+  static uint8_t output[2 * DATA_SIZE];
+  static const unsigned densities[] = { 0, 5, 30, 100 };
+
+  for (int round = 0; round < 2000 && test_failures == 0; round++) {
+    bool nvt = (round & 1) != 0;
+    size_t length = test_random(DATA_SIZE);
+    random_data(data, length, densities[(round / 2) % 4]);
+    size_t expected_length = reference_escape(data, length, expected, nvt);
+
+    // Escaping everything at once, and into buffers just big enough to hold an escaped byte or a little more
+    size_t consumed;
+    CHECK_BYTES(output, _escape(data, length, &consumed, output, sizeof(output), nvt), expected, expected_length);
+    CHECK(consumed == length);
+    size_t capacity = 2 + test_random(9);
+    size_t used = 0;
+    size_t produced = 0;
+    while (used < length) {
+      size_t size = _escape(&data[used], length - used, &consumed, &output[produced], capacity, nvt);
+      CHECK(consumed > 0 && size <= capacity);
+      if (consumed == 0) {
+        break;
+      }
+      used += consumed;
+      produced += size;
+    }
+    CHECK_BYTES(output, produced, expected, expected_length);
+
+    telnet_session_t session;
+    telnet_init(&session);
+    telnet_set_output_newlines(&session, nvt ? TELNET_NEWLINE_NVT : TELNET_NEWLINE_NONE);
+    CHECK(telnet_write_length(&session, data, length) == expected_length);
+
+    // telnet_write through the stack buffer and through small session buffers
+    for (size_t size = 0; size <= 16; size += 4) {
+      uint8_t buffer[16];
+      telnet_set_output_buffer(&session, (size > 0) ? buffer : NULL, size);
+      written_length = 0;
+      telnet_write(&session, data, length, collect);
+      CHECK_BYTES(written, written_length, expected, expected_length);
+    }
+    telnet_set_output_buffer(&session, NULL, 0);
+
+    if (length > 0) {
+      written_length = 0;
+      telnet_writev(&session, data, length, collect_segments);
+      CHECK_BYTES(written, written_length, expected, expected_length);
+    }
+
+    // An output queue that wraps around while it is written and drained
+    uint8_t storage[37];
+    telnet_output_queue_t queue;
+    telnet_set_output_queue(&session, &queue, storage, sizeof(storage), 0, sizeof(storage), NULL);
+    written_length = 0;
+    used = 0;
+    while (used < length) {
+      size_t queued = telnet_write(&session, &data[used], length - used, NULL);
+      used += queued;
+      if (queued == 0 && telnet_output_queued(&session) == 0) {
+        CHECK(!"the output queue made no progress");
+        break;
+      }
+      telnet_flush_output(&session, collect_queued);
+    }
+    while (telnet_flush_output(&session, collect_queued) > 0) {
+    }
+    CHECK_BYTES(written, written_length, expected, expected_length);
+
+    if (!nvt) {
+      CHECK_BYTES(output, telnet_escape(data, length, output, sizeof(output)), expected, expected_length);
+      used = 0;
+      produced = 0;
+      while (used < length) {
+        produced += telnet_write_to_buffer(&data[used], length - used, &output[produced], capacity, &consumed);
+        CHECK(consumed > 0);
+        if (consumed == 0) {
+          break;
+        }
+        used += consumed;
+      }
+      CHECK_BYTES(output, produced, expected, expected_length);
+    }
+  }
+}
+
+static void test_nvt_newlines(void) {
+  telnet_session_t session;
+  telnet_init(&session);
+  telnet_set_output_newlines(&session, TELNET_NEWLINE_NVT);
+
+  // Existing CR LF line endings are kept, only bare CR and LF are translated
+  const uint8_t data[] = { 'a', '\r', '\n', 'b', '\n', 'c', '\r', 'd', '\r' };
+  const uint8_t expected[] = { 'a', '\r', '\n', 'b', '\r', '\n', 'c', '\r', '\0', 'd', '\r', '\0' };
+  written_length = 0;
+  telnet_write(&session, data, sizeof(data), collect);
+  CHECK_BYTES(written, written_length, expected, sizeof(expected));
+  CHECK(telnet_write_length(&session, data, sizeof(data)) == sizeof(expected));
+
+  // Buffers smaller than an escaped IAC are refused instead of returning nothing forever
+  const uint8_t iac[] = { TELNET_IAC };
+  uint8_t output[2];
+  size_t consumed = 1;
+  CHECK(telnet_write_to_buffer(iac, 1, output, 1, &consumed) == 0 && consumed == 0);
+  CHECK(telnet_write_to_buffer(iac, 1, output, 2, &consumed) == 2 && consumed == 1);
+}
+
+static void test_writev(void) {
+  telnet_session_t session;
+  telnet_init(&session);
+  telnet_set_output_newlines(&session, TELNET_NEWLINE_NVT);
+
+  // Leading and repeated LFs give no empty segments
+  const uint8_t lines[] = { '\n', '\n', 'a', '\n' };
+  const uint8_t translated[] = { '\r', '\n', '\r', '\n', 'a', '\r', '\n' };
+  written_length = 0;
+  CHECK(telnet_writev(&session, lines, sizeof(lines), collect_segments) == sizeof(lines));
+  CHECK_BYTES(written, written_length, translated, sizeof(translated));
+
+  // Small writes are held by a flush policy and stay in order with telnet_write
+  static const telnet_flush_policy_t policy = { 16, 0, false };
+  uint8_t buffer[32];
+  telnet_set_output_newlines(&session, TELNET_NEWLINE_NONE);
+  telnet_set_output_buffer(&session, buffer, sizeof(buffer));
+  telnet_set_flush_policy(&session, &policy);
+  const uint8_t first[] = { 'a', TELNET_IAC };
+  const uint8_t second[] = { 'b', 'c' };
+  const uint8_t held[] = { 'a', TELNET_IAC, TELNET_IAC, 'b', 'c' };
+  written_length = 0;
+  telnet_write(&session, first, sizeof(first), collect);
+  CHECK(telnet_writev(&session, second, sizeof(second), collect_segments) == sizeof(second));
+  CHECK(written_length == 0);
+  telnet_flush(&session, collect);
+  CHECK_BYTES(written, written_length, held, sizeof(held));
+
+  // Past the threshold, held output is sent ahead of the data
+  uint8_t large[20];
+  memset(large, 'x', sizeof(large));
+  written_length = 0;
+  telnet_write(&session, first, sizeof(first), collect);
+  CHECK(telnet_writev(&session, large, sizeof(large), collect_segments) == sizeof(large));
+  CHECK(written_length == 3 + sizeof(large));
+  CHECK_BYTES(written, 3, held, 3);
+  telnet_set_flush_policy(&session, NULL);
+  telnet_set_output_buffer(&session, NULL, 0);
+
+  // With an output queue the data goes behind what is already queued, and what does not fit is refused
+  uint8_t storage[8];
+  telnet_output_queue_t queue;
+  telnet_set_output_queue(&session, &queue, storage, sizeof(storage), 0, sizeof(storage), NULL);
+  written_length = 0;
+  telnet_write(&session, first, sizeof(first), NULL);
+  CHECK(telnet_writev(&session, second, sizeof(second), collect_segments) == sizeof(second));
+  CHECK(written_length == 0);
+  CHECK(telnet_writev(&session, large, sizeof(large), collect_segments) == sizeof(storage) - sizeof(held));
+  while (telnet_flush_output(&session, collect_queued) > 0) {
+  }
+  CHECK_BYTES(written, sizeof(held), held, sizeof(held));
+  CHECK(written_length == sizeof(storage));
+}
+
+int main(void) {
+  test_selected_kernels();
+  test_kernels();
+  test_writes();
+  test_nvt_newlines();
+  test_writev();
+  return test_result("test_kernels");
+}
@@ -0,0 +1,366 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// Tests for option negotiation, negotiation scripts, dispatch tables, shared profiles, checkpoints
+// and the output buffer. Option changes go to a copy of the profile taken from a pool. This is also built with
+// `TELNET_SESSION_PROFILE` set to 1, where they go to the profile built into the session instead.
+
+#include "EmbeddedTelnet.h"
+#include "test.h"
+
+static uint8_t written[256];
+static size_t written_length;
+static int write_calls;
+
+static void collect(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  if (written_length + length <= sizeof(written)) {
+    memcpy(&written[written_length], data, length);
+    written_length += length;
+  }
+  write_calls++;
+}
+
+static void clear_written(void) {
+  written_length = 0;
+  write_calls = 0;
+}
+
+// Sessions without a profile of their own copy one into these blocks when their options are changed
+static uint8_t pool_storage[4][TELNET_POOL_BLOCK_SIZE(sizeof(telnet_profile_t))];
+static telnet_pool_t pool;
+
+static void new_session(telnet_session_t *session) {
+  telnet_init(session);
+  telnet_set_profile(session, NULL, &pool);
+}
+
+// Return any pool block the session holds
+static void free_session(telnet_session_t *session) {
+  telnet_set_profile(session, NULL, NULL);
+}
+
+// Feed bytes to the session as one read, collecting anything the session sends back
+static void receive(telnet_session_t *session, const uint8_t *data, size_t length, telnet_packet_callback_t callback) {
+  uint8_t buffer[64];
+  memcpy(buffer, data, length);
+  telnet_read(session, buffer, length, callback, collect);
+}
+
+#define RECEIVE(session, callback, ...)                                                  \
+  do {                                                                                   \
+    const uint8_t bytes_[] = { __VA_ARGS__ };                                            \
+    receive((session), bytes_, sizeof(bytes_), (callback));                              \
+  } while (0)
+
+#define EXPECT_WRITTEN(...)                                                              \
+  do {                                                                                   \
+    const uint8_t expected_[] = { __VA_ARGS__ };                                         \
+    CHECK_BYTES(written, written_length, expected_, sizeof(expected_));                  \
+  } while (0)
+
+#define EXPECT_NOTHING_WRITTEN() CHECK(written_length == 0)
+
+static void test_q_method(void) {
+  telnet_session_t session;
+  new_session(&session);
+  telnet_set_option(&session, TELNET_OPTION_ECHO, true);
+
+  // The peer asks for a supported option, we agree once and do not answer the same request again
+  clear_written();
+  RECEIVE(&session, NULL, TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO);
+  EXPECT_WRITTEN(TELNET_IAC, TELNET_WILL, TELNET_OPTION_ECHO);
+  CHECK(telnet_local_option_enabled(&session, TELNET_OPTION_ECHO));
+  clear_written();
+  RECEIVE(&session, NULL, TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO);
+  EXPECT_NOTHING_WRITTEN();
+
+  // Unsupported options are refused on either side
+  clear_written();
+  RECEIVE(&session, NULL, TELNET_IAC, TELNET_DO, 99, TELNET_IAC, TELNET_WILL, 99);
+  EXPECT_WRITTEN(TELNET_IAC, TELNET_WONT, 99, TELNET_IAC, TELNET_DONT, 99);
+  CHECK(!telnet_local_option_enabled(&session, 99));
+  CHECK(!telnet_remote_option_enabled(&session, 99));
+
+  // Our own request is not answered again when the peer agrees, and is not repeated once enabled
+  clear_written();
+  CHECK(telnet_request_option(&session, TELNET_DO, TELNET_OPTION_ECHO, collect));
+  EXPECT_WRITTEN(TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO);
+  clear_written();
+  RECEIVE(&session, NULL, TELNET_IAC, TELNET_WILL, TELNET_OPTION_ECHO);
+  EXPECT_NOTHING_WRITTEN();
+  CHECK(telnet_remote_option_enabled(&session, TELNET_OPTION_ECHO));
+  telnet_request_option(&session, TELNET_DO, TELNET_OPTION_ECHO, collect);
+  EXPECT_NOTHING_WRITTEN();
+
+  // A request that cannot be sent leaves the option alone, so it can be made again
+  CHECK(!telnet_request_option(&session, TELNET_WILL, TELNET_OPTION_SUPPRESS_GO_AHEAD, NULL));
+  CHECK(telnet_request_option(&session, TELNET_WILL, TELNET_OPTION_SUPPRESS_GO_AHEAD, collect));
+  EXPECT_WRITTEN(TELNET_IAC, TELNET_WILL, TELNET_OPTION_SUPPRESS_GO_AHEAD);
+  CHECK(!telnet_request_option(&session, TELNET_SB, TELNET_OPTION_ECHO, collect));
+  CHECK(!telnet_request_option(&session, TELNET_DO, 256, collect));
+
+  free_session(&session);
+}
+
+static void test_script(void) {
+  static const telnet_negotiation_t requests[] = {
+    { TELNET_WILL, TELNET_OPTION_ECHO, false },
+    { TELNET_DO, TELNET_OPTION_TERMINAL_TYPE, true },
+    { TELNET_DO, TELNET_OPTION_WINDOW_SIZE, false },
+  };
+  static const telnet_negotiation_t duplicate[] = {
+    { TELNET_DO, TELNET_OPTION_WINDOW_SIZE, false },
+    { TELNET_DO, TELNET_OPTION_WINDOW_SIZE, false },
+  };
+  static const telnet_negotiation_t out_of_range[] = {
+    { TELNET_DO, 256, false },
+  };
+  telnet_negotiation_script_t script;
+  uint8_t buffer[3 * 3];
+
+  CHECK(!telnet_script_init(&script, duplicate, 2, buffer, sizeof(buffer)));
+  CHECK(!telnet_script_init(&script, out_of_range, 1, buffer, sizeof(buffer)));
+  CHECK(!telnet_script_init(&script, requests, 3, buffer, sizeof(buffer) - 1));
+  CHECK(telnet_script_init(&script, requests, 3, buffer, sizeof(buffer)));
+
+  telnet_session_t session;
+  new_session(&session);
+  telnet_supported_options(&session, 3, TELNET_OPTION_ECHO, TELNET_OPTION_TERMINAL_TYPE, TELNET_OPTION_WINDOW_SIZE);
+
+  // A script that could not be sent changes nothing
+  CHECK(!telnet_start_negotiation(&session, &script, NULL));
+
+  // Every request goes out in a single write
+  clear_written();
+  CHECK(telnet_start_negotiation(&session, &script, collect));
+  CHECK(write_calls == 1);
+  EXPECT_WRITTEN(TELNET_IAC, TELNET_WILL, TELNET_OPTION_ECHO,
+                 TELNET_IAC, TELNET_DO, TELNET_OPTION_TERMINAL_TYPE,
+                 TELNET_IAC, TELNET_DO, TELNET_OPTION_WINDOW_SIZE);
+
+  // Agreeing to the terminal type is followed by the query, the other answers need no reply
+  clear_written();
+  RECEIVE(&session, NULL, TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO,
+          TELNET_IAC, TELNET_WILL, TELNET_OPTION_TERMINAL_TYPE,
+          TELNET_IAC, TELNET_WONT, TELNET_OPTION_WINDOW_SIZE);
+  EXPECT_WRITTEN(TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_SEND, TELNET_IAC, TELNET_SE);
+  CHECK(telnet_local_option_enabled(&session, TELNET_OPTION_ECHO));
+  CHECK(telnet_remote_option_enabled(&session, TELNET_OPTION_TERMINAL_TYPE));
+  CHECK(!telnet_remote_option_enabled(&session, TELNET_OPTION_WINDOW_SIZE));
+
+  free_session(&session);
+}
+
+static int naws_calls;
+static int ayt_calls;
+static int callback_calls;
+static telnet_packet_t naws_packet;
+static uint8_t naws_data[8];
+static telnet_command_t callback_command;
+
+static bool naws_handler(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  naws_calls++;
+  naws_packet = *packet;
+  if (packet->subnegotiation_length <= sizeof(naws_data)) {
+    memcpy(naws_data, packet->subnegotiation_data, packet->subnegotiation_length);
+  }
+  return true;
+}
+
+static bool ayt_handler(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  (void)packet;
+  ayt_calls++;
+  return true;
+}
+
+static bool packet_callback(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  callback_calls++;
+  callback_command = packet->command;
+  return true;
+}
+
+static void test_dispatch(void) {
+  telnet_dispatch_t dispatch;
+  telnet_dispatch_init(&dispatch);
+  CHECK(telnet_dispatch_option(&dispatch, TELNET_OPTION_WINDOW_SIZE, naws_handler));
+  CHECK(telnet_dispatch_command(&dispatch, TELNET_AYT, ayt_handler));
+  CHECK(!telnet_dispatch_command(&dispatch, TELNET_IAC, ayt_handler));
+
+  telnet_session_t session;
+  new_session(&session);
+  telnet_set_dispatch(&session, &dispatch);
+
+  // Handled packets go to their handlers, everything else, including unknown commands, to the callback
+  uint8_t input[] = { 'a', TELNET_IAC, TELNET_SB, TELNET_OPTION_WINDOW_SIZE, 0, 80, 0, 24, TELNET_IAC, TELNET_SE,
+                      'b', TELNET_IAC, TELNET_AYT, TELNET_IAC, 0x4A, 'c' };
+  size_t length = telnet_read(&session, input, sizeof(input), packet_callback, collect);
+  CHECK_BYTES(input, length, "abc", 3);
+  CHECK(naws_calls == 1);
+  CHECK(naws_packet.option == TELNET_OPTION_WINDOW_SIZE && naws_packet.subnegotiation_type == 0);
+  CHECK_BYTES(naws_data, naws_packet.subnegotiation_length, "\x50\x00\x18", 3);
+  CHECK(ayt_calls == 1);
+  CHECK(callback_calls == 1 && callback_command == 0x4A);
+
+  free_session(&session);
+}
+
+static void test_profile(void) {
+  telnet_profile_t profile;
+  telnet_profile_init(&profile);
+  telnet_profile_set_option(&profile, TELNET_OPTION_ECHO, true);
+
+  // Only the pool's single block is available
+  static uint8_t block[1][TELNET_POOL_BLOCK_SIZE(sizeof(telnet_profile_t))];
+  telnet_pool_t one_block;
+  telnet_pool_init(&one_block, block, sizeof(block[0]), 1);
+
+  telnet_session_t session;
+  telnet_session_t other;
+  telnet_init(&session);
+  telnet_init(&other);
+  telnet_set_profile(&session, &profile, &one_block);
+  telnet_set_profile(&other, &profile, NULL);
+  CHECK(telnet_get_option(&session, TELNET_OPTION_ECHO));
+
+  // Changing an option copies the profile, the shared profile and other sessions are not changed
+  telnet_set_option(&session, TELNET_OPTION_WINDOW_SIZE, true);
+  CHECK(telnet_get_option(&session, TELNET_OPTION_WINDOW_SIZE));
+  CHECK(telnet_get_option(&session, TELNET_OPTION_ECHO));
+  CHECK(!telnet_get_option(&other, TELNET_OPTION_WINDOW_SIZE));
+  CHECK(profile.local_supported[0] == (1u << TELNET_OPTION_ECHO));
+
+  // Setting the profile again hands back a block taken from the pool, and only that
+  telnet_set_profile(&session, &profile, &one_block);
+  telnet_set_profile(&session, &profile, &one_block);
+  CHECK(!telnet_get_option(&session, TELNET_OPTION_WINDOW_SIZE));
+  void *first = telnet_pool_alloc(&one_block);
+  CHECK(first != NULL);
+  CHECK(telnet_pool_alloc(&one_block) == NULL);
+#if !TELNET_SESSION_PROFILE
+  // Without a block the change cannot be made, and the caller is told so
+  CHECK(!telnet_set_option(&session, TELNET_OPTION_WINDOW_SIZE, true));
+  CHECK(!telnet_set_local_option(&session, TELNET_OPTION_WINDOW_SIZE, true));
+  CHECK(!telnet_set_remote_option(&session, TELNET_OPTION_WINDOW_SIZE, true));
+  CHECK(!telnet_supported_options(&session, 1, TELNET_OPTION_WINDOW_SIZE));
+  CHECK(!telnet_set_subnegotiation_option(&session, TELNET_OPTION_TERMINAL_TYPE, (const uint8_t *)"xterm"));
+  CHECK(!telnet_get_option(&session, TELNET_OPTION_WINDOW_SIZE));
+  CHECK(telnet_get_subnegotiation_option(&session, TELNET_OPTION_TERMINAL_TYPE) == NULL);
+#endif
+  telnet_pool_free(&one_block, first);
+
+  // Profile storage given to the session starts empty and takes option changes without a pool
+  telnet_profile_t storage;
+  telnet_set_profile_storage(&session, &storage);
+  CHECK(!telnet_get_option(&session, TELNET_OPTION_ECHO));
+  CHECK(telnet_set_option(&session, TELNET_OPTION_WINDOW_SIZE, true));
+  CHECK(storage.local_supported[0] == (1u << TELNET_OPTION_WINDOW_SIZE));
+
+  // It is also where a shared profile is copied to, so the pool keeps its block
+  telnet_set_profile(&session, &profile, &one_block);
+  CHECK(telnet_set_option(&session, TELNET_OPTION_BINARY, true));
+  CHECK(storage.local_supported[0] == ((1u << TELNET_OPTION_ECHO) | (1u << TELNET_OPTION_BINARY)));
+  first = telnet_pool_alloc(&one_block);
+  CHECK(first != NULL);
+  telnet_pool_free(&one_block, first);
+  CHECK(!telnet_set_subnegotiation_option(&session, TELNET_MAX_OPTIONS, (const uint8_t *)"xterm"));
+  telnet_set_profile_storage(&session, NULL);
+}
+
+static void test_checkpoint(void) {
+  static const uint8_t terminal[] = "VT100";
+  telnet_session_t session;
+  new_session(&session);
+  CHECK(telnet_checkpoint(&session, NULL, 0) == 26);
+
+  telnet_supported_options(&session, 2, TELNET_OPTION_ECHO, TELNET_OPTION_TERMINAL_TYPE);
+  telnet_set_subnegotiation_option(&session, TELNET_OPTION_TERMINAL_TYPE, terminal);
+  telnet_set_input_newlines(&session, TELNET_NEWLINE_NVT);
+  clear_written();
+  RECEIVE(&session, NULL, TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO, TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE);
+
+  uint8_t checkpoint[512];
+  size_t size = telnet_checkpoint(&session, checkpoint, sizeof(checkpoint));
+  CHECK(size > 26 && size == telnet_checkpoint(&session, NULL, 0));
+  CHECK(telnet_checkpoint(&session, checkpoint, size - 1) == 0);
+
+  // A session restored from a truncated checkpoint is refused
+  uint8_t arena_storage[64];
+  telnet_arena_t arena;
+  telnet_session_t restored;
+  for (size_t length = 0; length < size; length++) {
+    telnet_arena_init(&arena, arena_storage, sizeof(arena_storage));
+    new_session(&restored);
+    CHECK(!telnet_restore(&restored, checkpoint, length, &arena));
+    free_session(&restored);
+  }
+
+  // The restored session checkpoints to the same bytes and finishes the subnegotiation the original started
+  telnet_arena_init(&arena, arena_storage, sizeof(arena_storage));
+  new_session(&restored);
+  CHECK(telnet_restore(&restored, checkpoint, size, &arena));
+  uint8_t again[512];
+  CHECK_BYTES(again, telnet_checkpoint(&restored, again, sizeof(again)), checkpoint, size);
+  CHECK(telnet_local_option_enabled(&restored, TELNET_OPTION_ECHO));
+  clear_written();
+  RECEIVE(&restored, NULL, TELNET_SE_SEND, TELNET_IAC, TELNET_SE);
+  EXPECT_WRITTEN(TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_IS, 'V', 'T', '1', '0', '0',
+                 TELNET_IAC, TELNET_SE);
+
+  free_session(&restored);
+
+  // A checkpoint that lists the same subnegotiation option twice is refused
+  static const uint8_t size_value[] = "ABCDE";
+  CHECK(telnet_set_subnegotiation_option(&session, TELNET_OPTION_WINDOW_SIZE, size_value));
+  size = telnet_checkpoint(&session, checkpoint, sizeof(checkpoint));
+  telnet_arena_init(&arena, arena_storage, sizeof(arena_storage));
+  new_session(&restored);
+  CHECK(telnet_restore(&restored, checkpoint, size, &arena));
+  free_session(&restored);
+  // The options are last, in order, so the window size entry is the last 3 + 5 bytes
+  CHECK(checkpoint[size - 8] == TELNET_OPTION_WINDOW_SIZE);
+  checkpoint[size - 8] = TELNET_OPTION_TERMINAL_TYPE;
+  telnet_arena_init(&arena, arena_storage, sizeof(arena_storage));
+  new_session(&restored);
+  CHECK(!telnet_restore(&restored, checkpoint, size, &arena));
+  CHECK(telnet_get_subnegotiation_option(&restored, TELNET_OPTION_TERMINAL_TYPE) == NULL);
+  free_session(&restored);
+  free_session(&session);
+}
+
+static void test_output_buffer(void) {
+  static const telnet_flush_policy_t hold = { 0, 0, false };
+  uint8_t first[16];
+  uint8_t second[16];
+  telnet_session_t session;
+  new_session(&session);
+  CHECK(telnet_set_output_buffer(&session, first, sizeof(first)));
+  telnet_set_flush_policy(&session, &hold);
+
+  // Output held in one buffer is never lost by switching to another
+  clear_written();
+  telnet_write(&session, (const uint8_t *)"abc", 3, collect);
+  EXPECT_NOTHING_WRITTEN();
+  CHECK(!telnet_set_output_buffer(&session, second, sizeof(second)));
+  telnet_flush(&session, collect);
+  EXPECT_WRITTEN('a', 'b', 'c');
+  CHECK(telnet_set_output_buffer(&session, second, sizeof(second)));
+
+  free_session(&session);
+}
+
+int main(void) {
+  telnet_pool_init(&pool, pool_storage, sizeof(pool_storage[0]), 4);
+  test_q_method();
+  test_script();
+  test_dispatch();
+  test_profile();
+  test_checkpoint();
+  test_output_buffer();
+  return test_result("test_options");
+}
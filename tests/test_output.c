@@ -0,0 +1,332 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// Tests for the output side of a session: the output queue and its watermarks, automatic replies being
+// collected so each read writes them together, flush policies, and broadcasting to many sessions.
+
+#include "EmbeddedTelnet.h"
+#include "test.h"
+
+static uint8_t written[256];
+static size_t written_length;
+static int write_calls;
+
+// Take at most `accept_limit` bytes per call, as a socket with little room would
+static size_t accept_limit;
+
+static size_t collect_some(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  size_t accepted = (length < accept_limit) ? length : accept_limit;
+  memcpy(&written[written_length], data, accepted);
+  written_length += accepted;
+  write_calls++;
+  return accepted;
+}
+
+static void collect(telnet_session_t *session, const uint8_t *data, size_t length) {
+  accept_limit = sizeof(written) - written_length;
+  collect_some(session, data, length);
+}
+
+static void clear_written(void) {
+  written_length = 0;
+  write_calls = 0;
+}
+
+static telnet_output_event_t events[16];
+static int event_count;
+
+static void record_event(telnet_session_t *session, telnet_output_event_t event) {
+  (void)session;
+  if (event_count < 16) {
+    events[event_count] = event;
+  }
+  event_count++;
+}
+
+static void test_output_queue(void) {
+  telnet_session_t session;
+  telnet_output_queue_t queue;
+  uint8_t storage[16];
+  telnet_init(&session);
+  telnet_set_output_queue(&session, &queue, storage, sizeof(storage), 4, 12, record_event);
+  event_count = 0;
+
+  // Filling up to the high watermark notifies once, however much more is queued
+  const uint8_t data[] = "abcdefghijklmnopqrstuvwxyz";
+  CHECK(telnet_write(&session, data, 8, NULL) == 8);
+  CHECK(event_count == 0);
+  CHECK(telnet_write(&session, &data[8], 4, NULL) == 4);
+  CHECK(event_count == 1 && events[0] == TELNET_OUTPUT_HIGH_WATERMARK);
+  CHECK(telnet_write(&session, &data[12], 2, NULL) == 2);
+  CHECK(event_count == 1);
+  CHECK(telnet_output_queued(&session) == 14);
+
+  // What does not fit is refused, and a packet is never partly queued
+  CHECK(telnet_write(&session, &data[14], 10, NULL) == 2);
+  CHECK(event_count == 2 && events[1] == TELNET_OUTPUT_OVERFLOW);
+  telnet_packet_t packet;
+  telnet_init_packet(&packet);
+  packet.command = TELNET_NOP;
+  telnet_write_packet(&session, &packet, NULL);
+  CHECK(event_count == 3 && events[2] == TELNET_OUTPUT_OVERFLOW);
+  CHECK(telnet_output_queued(&session) == 16);
+
+  // Draining notifies once the queue is down to the low watermark, not before and not twice
+  clear_written();
+  accept_limit = 6;
+  CHECK(telnet_flush_output(&session, collect_some) == 10);
+  CHECK(event_count == 3);
+  CHECK(telnet_flush_output(&session, collect_some) == 4);
+  CHECK(event_count == 4 && events[3] == TELNET_OUTPUT_LOW_WATERMARK);
+  CHECK(telnet_flush_output(&session, collect_some) == 0);
+  CHECK(event_count == 4);
+  CHECK_BYTES(written, written_length, data, 16);
+
+  // The queue wraps around, and automatic replies are queued behind earlier output
+  CHECK(telnet_write(&session, data, 14, NULL) == 14);
+  CHECK(event_count == 5 && events[4] == TELNET_OUTPUT_HIGH_WATERMARK);
+  CHECK(telnet_flush_output(&session, collect_some) == 8);
+  uint8_t request[] = { TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO };
+  telnet_read(&session, request, sizeof(request), NULL, NULL);
+  CHECK(telnet_output_queued(&session) == 11);
+  const uint8_t expected[] = { 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', TELNET_IAC, TELNET_WONT, TELNET_OPTION_ECHO };
+  clear_written();
+  accept_limit = sizeof(written);
+  CHECK(telnet_flush_output(&session, collect_some) == 0);
+  CHECK_BYTES(written, written_length, expected, sizeof(expected));
+  CHECK(write_calls == 2);
+  CHECK(event_count == 6 && events[5] == TELNET_OUTPUT_LOW_WATERMARK);
+  telnet_set_output_queue(&session, NULL, NULL, 0, 0, 0, NULL);
+  CHECK(telnet_output_queued(&session) == 0);
+}
+
+// Fill data with `count` DO requests for options the session refuses, returning the length
+static size_t refused_requests(uint8_t *data, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    data[3 * i] = TELNET_IAC;
+    data[3 * i + 1] = TELNET_DO;
+    data[3 * i + 2] = (uint8_t)(100 + i);
+  }
+  return 3 * count;
+}
+
+// Writes a line whenever the client sends a NOP, and leaves everything else to the automatic replies
+static bool write_on_nop(telnet_session_t *session, const telnet_packet_t *packet) {
+  if (packet->command == TELNET_NOP) {
+    const uint8_t line[] = { 'o', 'k' };
+    telnet_write(session, line, sizeof(line), collect);
+  }
+  return true;
+}
+
+static void test_reply_coalescing(void) {
+  telnet_session_t session;
+  uint8_t data[3 * 32];
+  uint8_t expected[3 * 32];
+  for (size_t i = 0; i < 32; i++) {
+    expected[3 * i] = TELNET_IAC;
+    expected[3 * i + 1] = TELNET_WONT;
+    expected[3 * i + 2] = (uint8_t)(100 + i);
+  }
+
+  // A client opening with a dozen requests gets all the replies in one write
+  telnet_init(&session);
+  clear_written();
+  size_t length = refused_requests(data, 12);
+  telnet_read(&session, data, length, NULL, collect);
+  CHECK(write_calls == 1);
+  CHECK_BYTES(written, written_length, expected, 36);
+
+  // The same through telnet_read_into and telnet_read_events, and split across reads, one write per read
+  telnet_init(&session);
+  clear_written();
+  length = refused_requests(data, 12);
+  uint8_t output[8];
+  size_t consumed;
+  telnet_read_into(&session, data, 18, output, sizeof(output), &consumed, NULL, collect);
+  CHECK(consumed == 18 && write_calls == 1);
+  telnet_event_t events[16];
+  telnet_read_events(&session, &data[18], length - 18, events, 16, &consumed, collect);
+  CHECK(consumed == length - 18 && write_calls == 2);
+  CHECK_BYTES(written, written_length, expected, 36);
+
+  // More replies than the reply buffer holds are written whenever it fills
+  telnet_init(&session);
+  clear_written();
+  length = refused_requests(data, 32);
+  telnet_read(&session, data, length, NULL, collect);
+  CHECK(write_calls == (int)((length + TELNET_REPLY_BUFFER_SIZE - 1) / TELNET_REPLY_BUFFER_SIZE));
+  CHECK_BYTES(written, written_length, expected, length);
+
+  // Output written from a callback goes out behind the replies made before it, in the same write
+  telnet_init(&session);
+  clear_written();
+  uint8_t mixed[] = { TELNET_IAC, TELNET_DO, 100, TELNET_IAC, TELNET_NOP, TELNET_IAC, TELNET_DO, 101 };
+  const uint8_t mixed_expected[] = { TELNET_IAC, TELNET_WONT, 100, 'o', 'k', TELNET_IAC, TELNET_WONT, 101 };
+  telnet_read(&session, mixed, sizeof(mixed), write_on_nop, collect);
+  CHECK_BYTES(written, written_length, mixed_expected, sizeof(mixed_expected));
+  CHECK(write_calls == 2);
+}
+
+static void test_flush_policy(void) {
+  telnet_session_t session;
+  uint8_t buffer[32];
+  const uint8_t data[] = "abcdefgh";
+  telnet_init(&session);
+  telnet_set_output_buffer(&session, buffer, sizeof(buffer));
+
+  // Output is held until the size threshold is reached, then sent in one write
+  static const telnet_flush_policy_t threshold = { 8, 0, false };
+  telnet_set_flush_policy(&session, &threshold);
+  clear_written();
+  telnet_write(&session, data, 3, collect);
+  CHECK(write_calls == 0);
+  telnet_write(&session, &data[3], 5, collect);
+  CHECK(write_calls == 1);
+  CHECK_BYTES(written, written_length, data, 8);
+
+  // Or until the deadline passes, also when the clock wraps around
+  static const telnet_flush_policy_t deadline = { 0, 10, false };
+  telnet_set_flush_policy(&session, &deadline);
+  static const uint32_t starts[] = { 100, 0xFFFFFFFA };
+  for (int i = 0; i < 2; i++) {
+    clear_written();
+    telnet_poll(&session, starts[i], collect);
+    telnet_write(&session, data, 4, collect);
+    telnet_poll(&session, starts[i] + 9, collect);
+    CHECK(write_calls == 0);
+    telnet_poll(&session, starts[i] + 10, collect);
+    CHECK(write_calls == 1);
+    CHECK_BYTES(written, written_length, data, 4);
+  }
+
+  // Or until a prompt is written, which goes out with the held output
+  static const telnet_flush_policy_t prompt = { 0, 0, true };
+  telnet_set_flush_policy(&session, &prompt);
+  clear_written();
+  telnet_write(&session, data, 2, collect);
+  telnet_packet_t packet;
+  telnet_init_packet(&packet);
+  packet.command = TELNET_GA;
+  telnet_write_packet(&session, &packet, collect);
+  const uint8_t prompted[] = { 'a', 'b', TELNET_IAC, TELNET_GA };
+  CHECK_BYTES(written, written_length, prompted, sizeof(prompted));
+  CHECK(write_calls == 1);
+
+  // Automatic subnegotiation replies are sent at the end of the read with the held output
+  // ahead of them, however the policy would hold them
+  telnet_set_flush_policy(&session, &deadline);
+  static telnet_profile_t profile;
+  telnet_profile_init(&profile);
+  telnet_profile_set_subnegotiation_option(&profile, TELNET_OPTION_TERMINAL_TYPE, (const uint8_t *)"xterm");
+  telnet_set_profile(&session, &profile, NULL);
+  clear_written();
+  telnet_write(&session, data, 2, collect);
+  uint8_t request[] = { TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_SEND, TELNET_IAC, TELNET_SE };
+  telnet_read(&session, request, sizeof(request), NULL, collect);
+  const uint8_t replied[] = { 'a', 'b', TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_IS,
+                              'x', 't', 'e', 'r', 'm', TELNET_IAC, TELNET_SE };
+  CHECK_BYTES(written, written_length, replied, sizeof(replied));
+  CHECK(write_calls == 1);
+
+  // A subnegotiation reply too long for the reply buffer is not held either
+  static uint8_t long_value[TELNET_REPLY_BUFFER_SIZE + 1];
+  memset(long_value, 'v', sizeof(long_value) - 1);
+  telnet_profile_set_subnegotiation_option(&profile, TELNET_OPTION_TERMINAL_TYPE, long_value);
+  clear_written();
+  telnet_write(&session, data, 2, collect);
+  uint8_t send[] = { TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_SEND, TELNET_IAC, TELNET_SE };
+  telnet_read(&session, send, sizeof(send), NULL, collect);
+  CHECK(written_length == 2 + 6 + sizeof(long_value) - 1);
+  CHECK(written[0] == 'a' && written[2] == TELNET_IAC && written[written_length - 1] == TELNET_SE);
+  size_t sent = written_length;
+  telnet_flush(&session, collect);
+  CHECK(written_length == sent);
+  telnet_set_flush_policy(&session, NULL);
+}
+
+// Broadcast output is kept apart for each session
+static telnet_session_t *recipients[5];
+static uint8_t received[5][16];
+static size_t received_length[5];
+static int received_calls[5];
+
+static void receive(telnet_session_t *session, const uint8_t *data, size_t length) {
+  for (int i = 0; i < 5; i++) {
+    if (recipients[i] == session && received_length[i] + length <= sizeof(received[i])) {
+      memcpy(&received[i][received_length[i]], data, length);
+      received_length[i] += length;
+      received_calls[i]++;
+    }
+  }
+}
+
+static size_t receive_queued(telnet_session_t *session, const uint8_t *data, size_t length) {
+  receive(session, data, length);
+  return length;
+}
+
+static void ignore(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  (void)data;
+  (void)length;
+}
+
+static void test_broadcast(void) {
+  // A plain session, one with NVT newlines, one with NVT newlines that has agreed to send binary data,
+  // and two with output queues, only one of which has room for the message
+  telnet_session_t sessions[5];
+  static telnet_profile_t profile;
+  telnet_profile_init(&profile);
+  telnet_profile_set_option(&profile, TELNET_OPTION_BINARY, true);
+  for (int i = 0; i < 5; i++) {
+    telnet_init(&sessions[i]);
+    recipients[i] = &sessions[i];
+  }
+  telnet_set_output_newlines(&sessions[1], TELNET_NEWLINE_NVT);
+  telnet_set_output_newlines(&sessions[2], TELNET_NEWLINE_NVT);
+  telnet_set_profile(&sessions[2], &profile, NULL);
+  uint8_t binary[] = { TELNET_IAC, TELNET_DO, TELNET_OPTION_BINARY };
+  telnet_read(&sessions[2], binary, sizeof(binary), NULL, ignore);
+  telnet_output_queue_t queues[2];
+  uint8_t roomy[16];
+  uint8_t full[4];
+  telnet_set_output_queue(&sessions[3], &queues[0], roomy, sizeof(roomy), 0, sizeof(roomy), NULL);
+  telnet_set_output_queue(&sessions[4], &queues[1], full, sizeof(full), 0, sizeof(full), NULL);
+
+  const uint8_t message[] = { 'h', 'i', '\n', TELNET_IAC };
+  const uint8_t plain[] = { 'h', 'i', '\n', TELNET_IAC, TELNET_IAC };
+  const uint8_t nvt[] = { 'h', 'i', '\r', '\n', TELNET_IAC, TELNET_IAC };
+  telnet_session_t *const list[] = { &sessions[0], NULL, &sessions[1], &sessions[2], &sessions[3], &sessions[4] };
+
+  // Each session gets its own mode's encoding in one write, whether the message is encoded once for all of them
+  // or, with no room in the buffer, by each session
+  static const size_t capacities[] = { 4 * sizeof(message), 2 };
+  for (int c = 0; c < 2; c++) {
+    uint8_t buffer[4 * sizeof(message)];
+    memset(received_length, 0, sizeof(received_length));
+    memset(received_calls, 0, sizeof(received_calls));
+    CHECK(telnet_broadcast(list, 6, message, sizeof(message), buffer, capacities[c], receive) == 4);
+    CHECK_BYTES(received[0], received_length[0], plain, sizeof(plain));
+    CHECK_BYTES(received[1], received_length[1], nvt, sizeof(nvt));
+    CHECK_BYTES(received[2], received_length[2], plain, sizeof(plain));
+    CHECK(received_calls[0] == 1 && received_calls[1] == 1 && received_calls[2] == 1);
+    CHECK(telnet_output_queued(&sessions[3]) == sizeof(plain));
+    CHECK(telnet_output_queued(&sessions[4]) == 0);
+    telnet_flush_output(&sessions[3], receive_queued);
+    CHECK_BYTES(received[3], received_length[3], plain, sizeof(plain));
+    CHECK(received_length[4] == 0);
+  }
+  CHECK(telnet_broadcast(list, 6, NULL, 4, NULL, 0, receive) == 0);
+}
+
+int main(void) {
+  test_output_queue();
+  test_reply_coalescing();
+  test_flush_policy();
+  test_broadcast();
+  return test_result("test_output");
+}
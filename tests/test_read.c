@@ -0,0 +1,679 @@
+/*
+Copyright (c) 2025 Andrew C. Young <andrew@vaelen.org>
+MIT License, see the LICENSE file for details.
+*/
+
+// Parsing must not depend on where the input is split. Every test here parses a stream in one go and then
+// again in pieces, with telnet_read, telnet_read_into and telnet_read_events, and expects the same data and packets.
+
+#include <EmbeddedTelnet.h>
+#include "test.h"
+
+#define STREAM_SIZE 512
+#define LOG_SIZE 8192
+
+// What a session received: the data and a record of each packet
+typedef struct {
+  uint8_t data[STREAM_SIZE * 2];
+  size_t data_length;
+  uint8_t packets[LOG_SIZE];
+  size_t packets_length;
+} received_t;
+
+static received_t *current;
+
+static void log_byte(received_t *received, uint8_t byte) {
+  if (received->packets_length < LOG_SIZE) {
+    received->packets[received->packets_length++] = byte;
+  }
+}
+
+// Commands are logged with their option, subnegotiations also with their type and data
+static void log_packet(received_t *received, telnet_command_t command, telnet_option_t option,
+                       telnet_subnegotiation_t type, const uint8_t *data, size_t length) {
+  log_byte(received, (uint8_t)command);
+  if (command >= TELNET_SB) {
+    log_byte(received, (uint8_t)option);
+  }
+  if (command == TELNET_SB) {
+    log_byte(received, (uint8_t)type);
+    log_byte(received, (uint8_t)length);
+    for (size_t i = 0; i < length; i++) {
+      log_byte(received, data[i]);
+    }
+  }
+}
+
+static bool record_packet(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  log_packet(current, packet->command, packet->option, packet->subnegotiation_type, packet->subnegotiation_data,
+             packet->subnegotiation_length);
+  return true;
+}
+
+static void append_data(received_t *received, const uint8_t *data, size_t length) {
+  memcpy(&received->data[received->data_length], data, length);
+  received->data_length += length;
+}
+
+static void ignore_writer(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  (void)data;
+  (void)length;
+}
+
+// Build a random stream of data, escaped IACs, commands, negotiations and subnegotiations
+static size_t random_stream(uint8_t *stream, size_t size) {
+  static const uint8_t commands[] = { TELNET_NOP, TELNET_DM, TELNET_BRK, TELNET_IP, TELNET_AO, TELNET_AYT,
+                                      TELNET_EC, TELNET_EL, TELNET_GA, TELNET_EOR };
+  size_t length = 0;
+  while (length + 24 < size) {
+    switch (test_random(5)) {
+      case 0:
+        for (unsigned i = 1 + test_random(12); i > 0; i--) {
+          stream[length++] = (uint8_t)('a' + test_random(26));
+        }
+        break;
+      case 1:
+        stream[length++] = TELNET_IAC;
+        stream[length++] = TELNET_IAC;
+        break;
+      case 2:
+        stream[length++] = TELNET_IAC;
+        stream[length++] = commands[test_random(sizeof(commands))];
+        break;
+      case 3:
+        stream[length++] = TELNET_IAC;
+        stream[length++] = (uint8_t)(TELNET_WILL + test_random(4));
+        stream[length++] = (uint8_t)test_random(256);
+        break;
+      default:
+        stream[length++] = TELNET_IAC;
+        stream[length++] = TELNET_SB;
+        stream[length++] = (uint8_t)test_random(256);
+        stream[length++] = (uint8_t)test_random(2);
+        for (unsigned i = test_random(8); i > 0; i--) {
+          uint8_t byte = (uint8_t)(test_random(4) == 0 ? TELNET_IAC : 'A' + test_random(26));
+          stream[length++] = byte;
+          if (byte == TELNET_IAC) {
+            stream[length++] = TELNET_IAC;
+          }
+        }
+        stream[length++] = TELNET_IAC;
+        stream[length++] = TELNET_SE;
+        break;
+    }
+  }
+  return length;
+}
+
+// Build a random stream of text with NVT newlines, bare CRs and telnet commands between them
+static size_t random_text(uint8_t *stream, size_t size) {
+  static const char *pieces[] = { "\r\n", "\r", "\n", "\r\r\n", "\r\n\r" };
+  size_t length = 0;
+  while (length + 8 < size) {
+    switch (test_random(5)) {
+      case 0:
+      case 1:
+        stream[length++] = (uint8_t)('a' + test_random(26));
+        break;
+      case 2: {
+        const char *piece = pieces[test_random(sizeof(pieces) / sizeof(pieces[0]))];
+        memcpy(&stream[length], piece, strlen(piece));
+        length += strlen(piece);
+        break;
+      }
+      case 3:
+        stream[length++] = '\r';
+        stream[length++] = '\0';
+        break;
+      default:
+        stream[length++] = TELNET_IAC;
+        stream[length++] = (test_random(2) == 0) ? TELNET_IAC : TELNET_NOP;
+        break;
+    }
+  }
+  return length;
+}
+
+// Split points for a stream, either random pieces or every piece the same size
+static size_t next_piece(size_t remaining, size_t piece) {
+  size_t length = (piece > 0) ? piece : 1 + test_random(9);
+  return (length < remaining) ? length : remaining;
+}
+
+static void read_in_place(telnet_session_t *session, const uint8_t *stream, size_t length, size_t piece,
+                          received_t *received) {
+  current = received;
+  size_t position = 0;
+  while (position < length) {
+    // One spare byte for a CR held back from the previous piece
+    uint8_t buffer[STREAM_SIZE + 1];
+    size_t size = next_piece(length - position, piece);
+    memcpy(buffer, &stream[position], size);
+    append_data(received, buffer, telnet_read(session, buffer, size, record_packet, ignore_writer));
+    position += size;
+  }
+}
+
+static void read_into(telnet_session_t *session, const uint8_t *stream, size_t length, size_t piece,
+                      size_t capacity, received_t *received) {
+  current = received;
+  size_t position = 0;
+  while (position < length) {
+    size_t size = next_piece(length - position, piece);
+    size_t used = 0;
+    while (used < size) {
+      uint8_t output[STREAM_SIZE];
+      size_t consumed;
+      size_t produced = telnet_read_into(session, &stream[position + used], size - used, output, capacity, &consumed,
+                                         record_packet, ignore_writer);
+      append_data(received, output, produced);
+      used += consumed;
+      if (consumed == 0 && produced == 0) {
+        CHECK(!"telnet_read_into made no progress");
+        return;
+      }
+    }
+    position += size;
+  }
+}
+
+static void read_events(telnet_session_t *session, const uint8_t *stream, size_t length, size_t piece,
+                        size_t max_events, received_t *received) {
+  uint8_t subnegotiation[STREAM_SIZE];
+  size_t subnegotiation_length = 0;
+  size_t position = 0;
+  while (position < length) {
+    size_t size = next_piece(length - position, piece);
+    size_t used = 0;
+    while (used < size) {
+      telnet_event_t events[8];
+      size_t consumed;
+      size_t count = telnet_read_events(session, &stream[position + used], size - used, events, max_events, &consumed,
+                                        ignore_writer);
+      for (size_t i = 0; i < count; i++) {
+        const telnet_event_t *event = &events[i];
+        if (event->type == TELNET_EVENT_DATA) {
+          append_data(received, event->data, event->length);
+        } else if (event->type == TELNET_EVENT_SUBNEGOTIATION_DATA) {
+          memcpy(&subnegotiation[subnegotiation_length], event->data, event->length);
+          subnegotiation_length += event->length;
+        } else {
+          log_packet(received, event->command, event->option, event->subnegotiation_type, subnegotiation,
+                     subnegotiation_length);
+          subnegotiation_length = 0;
+        }
+      }
+      used += consumed;
+      if (consumed == 0 && count == 0) {
+        CHECK(!"telnet_read_events made no progress");
+        return;
+      }
+    }
+    position += size;
+  }
+}
+
+static void check_same(const received_t *actual, const received_t *expected) {
+  CHECK_BYTES(actual->data, actual->data_length, expected->data, expected->data_length);
+  CHECK_BYTES(actual->packets, actual->packets_length, expected->packets, expected->packets_length);
+}
+
+static void test_random_splits(void) {
+  static received_t whole;
+  static received_t pieces;
+  for (int round = 0; round < 300 && test_failures == 0; round++) {
+    uint8_t stream[STREAM_SIZE];
+    size_t length = random_stream(stream, sizeof(stream));
+
+    telnet_session_t session;
+    telnet_init(&session);
+    memset(&whole, 0, sizeof(whole));
+    read_in_place(&session, stream, length, length, &whole);
+
+    // In place, in random pieces and one byte at a time
+    for (size_t piece = 0; piece <= 1; piece++) {
+      telnet_init(&session);
+      memset(&pieces, 0, sizeof(pieces));
+      read_in_place(&session, stream, length, piece, &pieces);
+      check_same(&pieces, &whole);
+    }
+
+    // Into a small output buffer, so reads also stop when the output is full
+    for (size_t capacity = 1; capacity <= 5; capacity += 2) {
+      telnet_init(&session);
+      memset(&pieces, 0, sizeof(pieces));
+      read_into(&session, stream, length, 0, capacity, &pieces);
+      check_same(&pieces, &whole);
+    }
+
+    // As events, with room for only a few events at a time
+    for (size_t max_events = 1; max_events <= 8; max_events *= 8) {
+      telnet_init(&session);
+      memset(&pieces, 0, sizeof(pieces));
+      read_events(&session, stream, length, 0, max_events, &pieces);
+      check_same(&pieces, &whole);
+    }
+  }
+}
+
+static void test_escaped_iac_split(void) {
+  static received_t received;
+  const uint8_t stream[] = { 'a', TELNET_IAC, TELNET_IAC, 'b' };
+  const uint8_t expected[] = { 'a', TELNET_IAC, 'b' };
+  for (size_t split = 1; split < sizeof(stream); split++) {
+    telnet_session_t session;
+    telnet_init(&session);
+    memset(&received, 0, sizeof(received));
+    read_in_place(&session, stream, split, split, &received);
+    read_in_place(&session, &stream[split], sizeof(stream) - split, sizeof(stream), &received);
+    CHECK_BYTES(received.data, received.data_length, expected, sizeof(expected));
+    CHECK(received.packets_length == 0);
+  }
+}
+
+static void test_subnegotiation_split(void) {
+  static received_t whole;
+  static received_t received;
+  const uint8_t stream[] = { 'x', TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_IS,
+                             'v', 't', TELNET_IAC, TELNET_IAC, '1', TELNET_IAC, TELNET_SE, 'y' };
+  const uint8_t expected[] = { TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_IS, 4, 'v', 't', TELNET_IAC, '1' };
+  telnet_session_t session;
+  telnet_init(&session);
+  memset(&whole, 0, sizeof(whole));
+  read_in_place(&session, stream, sizeof(stream), sizeof(stream), &whole);
+  CHECK_BYTES(whole.packets, whole.packets_length, expected, sizeof(expected));
+  CHECK_BYTES(whole.data, whole.data_length, "xy", 2);
+
+  // Every way of splitting the stream in three
+  for (size_t first = 1; first < sizeof(stream); first++) {
+    for (size_t second = first; second < sizeof(stream); second++) {
+      telnet_init(&session);
+      memset(&received, 0, sizeof(received));
+      read_in_place(&session, stream, first, first, &received);
+      read_in_place(&session, &stream[first], second - first, sizeof(stream), &received);
+      read_in_place(&session, &stream[second], sizeof(stream) - second, sizeof(stream), &received);
+      check_same(&received, &whole);
+    }
+  }
+}
+
+// Read one piece of a stream with NVT newlines, in place or into a separate buffer
+#define PIECE(text) (const uint8_t *)(text), sizeof(text) - 1
+
+static size_t read_nvt(telnet_session_t *session, const uint8_t *piece, size_t length, uint8_t *output, bool in_place) {
+  memcpy(output, piece, length);
+  if (in_place) {
+    return telnet_read(session, output, length, NULL, NULL);
+  }
+  uint8_t input[16];
+  memcpy(input, piece, length);
+  return telnet_read_into(session, input, length, output, 16, NULL, NULL, NULL);
+}
+
+static void test_newline_split(void) {
+  for (int in_place = 0; in_place <= 1; in_place++) {
+    telnet_session_t session;
+    telnet_init(&session);
+    telnet_set_input_newlines(&session, TELNET_NEWLINE_NVT);
+    uint8_t output[16];
+
+    // CR LF and CR NUL split after the CR
+    CHECK_BYTES(output, read_nvt(&session, PIECE("a\r"), output, in_place), "a", 1);
+    CHECK_BYTES(output, read_nvt(&session, PIECE("\nb\r"), output, in_place), "\nb", 2);
+    CHECK_BYTES(output, read_nvt(&session, PIECE("\0c"), output, in_place), "\rc", 2);
+
+    // A bare CR split from the data after it is passed on, in place it takes the spare byte
+    CHECK_BYTES(output, read_nvt(&session, PIECE("x\r"), output, in_place), "x", 1);
+    CHECK_BYTES(output, read_nvt(&session, PIECE("yz"), output, in_place), "\ryz", 3);
+
+    // Keys typed one at a time arrive without delay after a bare CR
+    CHECK_BYTES(output, read_nvt(&session, PIECE("x\r"), output, in_place), "x", 1);
+    CHECK_BYTES(output, read_nvt(&session, PIECE("y"), output, in_place), "\ry", 2);
+    CHECK_BYTES(output, read_nvt(&session, PIECE("z"), output, in_place), "z", 1);
+    CHECK_BYTES(output, read_nvt(&session, PIECE("w"), output, in_place), "w", 1);
+  }
+}
+
+static void test_newline_random_splits(void) {
+  static received_t whole;
+  static received_t pieces;
+  for (int round = 0; round < 300 && test_failures == 0; round++) {
+    uint8_t stream[STREAM_SIZE];
+    size_t length = random_text(stream, sizeof(stream));
+
+    telnet_session_t session;
+    telnet_init(&session);
+    telnet_set_input_newlines(&session, TELNET_NEWLINE_NVT);
+    memset(&whole, 0, sizeof(whole));
+    read_in_place(&session, stream, length, length, &whole);
+
+    // In place, in random pieces and one byte at a time
+    for (size_t piece = 0; piece <= 1; piece++) {
+      telnet_init(&session);
+      telnet_set_input_newlines(&session, TELNET_NEWLINE_NVT);
+      memset(&pieces, 0, sizeof(pieces));
+      read_in_place(&session, stream, length, piece, &pieces);
+      check_same(&pieces, &whole);
+    }
+
+    // Down to a single byte of output, which must still make progress when a bare CR is owed
+    for (size_t capacity = 1; capacity <= 3; capacity++) {
+      telnet_init(&session);
+      telnet_set_input_newlines(&session, TELNET_NEWLINE_NVT);
+      memset(&pieces, 0, sizeof(pieces));
+      read_into(&session, stream, length, 0, capacity, &pieces);
+      check_same(&pieces, &whole);
+    }
+  }
+}
+
+static void test_command_split(void) {
+  static received_t received;
+  const uint8_t stream[] = { TELNET_IAC, TELNET_DO, TELNET_OPTION_ECHO, TELNET_IAC, TELNET_AYT };
+  const uint8_t expected[] = { TELNET_DO, TELNET_OPTION_ECHO, TELNET_AYT };
+  for (size_t split = 1; split < sizeof(stream); split++) {
+    telnet_session_t session;
+    telnet_init(&session);
+    memset(&received, 0, sizeof(received));
+    read_in_place(&session, stream, split, split, &received);
+    read_in_place(&session, &stream[split], sizeof(stream) - split, sizeof(stream), &received);
+    CHECK_BYTES(received.packets, received.packets_length, expected, sizeof(expected));
+    CHECK(received.data_length == 0);
+  }
+}
+
+// A command other than SE ends a subnegotiation early. The subnegotiation is delivered as it is,
+// and the command is parsed as a packet of its own rather than left in the data.
+static void test_subnegotiation_abort(void) {
+  static received_t whole;
+  static received_t received;
+  const uint8_t stream[] = { 'x', TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_IS, 'a', 'b',
+                             TELNET_IAC, TELNET_NOP, 'y', TELNET_IAC, TELNET_SB, TELNET_OPTION_WINDOW_SIZE, TELNET_SE_IS,
+                             'c', TELNET_IAC, TELNET_WILL, TELNET_OPTION_ECHO, 'z' };
+  const uint8_t expected[] = { TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_IS, 2, 'a', 'b', TELNET_NOP,
+                               TELNET_SB, TELNET_OPTION_WINDOW_SIZE, TELNET_SE_IS, 1, 'c',
+                               TELNET_WILL, TELNET_OPTION_ECHO };
+  telnet_session_t session;
+  telnet_init(&session);
+  memset(&whole, 0, sizeof(whole));
+  read_in_place(&session, stream, sizeof(stream), sizeof(stream), &whole);
+  CHECK_BYTES(whole.packets, whole.packets_length, expected, sizeof(expected));
+  CHECK_BYTES(whole.data, whole.data_length, "xyz", 3);
+
+  for (size_t split = 1; split < sizeof(stream); split++) {
+    telnet_init(&session);
+    memset(&received, 0, sizeof(received));
+    read_in_place(&session, stream, split, split, &received);
+    read_in_place(&session, &stream[split], sizeof(stream) - split, sizeof(stream), &received);
+    check_same(&received, &whole);
+  }
+  telnet_init(&session);
+  memset(&received, 0, sizeof(received));
+  read_events(&session, stream, sizeof(stream), 1, 8, &received);
+  check_same(&received, &whole);
+}
+
+// Streamed subnegotiations, larger than the subnegotiation buffer, as the application sees them
+static struct {
+  int begins;
+  int ends;
+  telnet_option_t option;
+  telnet_subnegotiation_t type;
+  uint8_t data[STREAM_SIZE];
+  size_t length;
+} streamed;
+
+static void stream_begin(telnet_session_t *session, telnet_option_t option, telnet_subnegotiation_t type) {
+  (void)session;
+  streamed.begins++;
+  streamed.option = option;
+  streamed.type = type;
+}
+
+static void stream_data(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  if (streamed.length + length <= sizeof(streamed.data)) {
+    memcpy(&streamed.data[streamed.length], data, length);
+  }
+  streamed.length += length;
+}
+
+static bool stream_end(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  streamed.ends++;
+  CHECK(packet->command == TELNET_SB && packet->option == streamed.option);
+  CHECK(packet->subnegotiation_length == 0);
+  return true;
+}
+
+static void test_streamed_subnegotiation(void) {
+  static const telnet_subnegotiation_stream_t stream = { stream_begin, stream_data, stream_end };
+  static received_t received;
+  uint8_t payload[300];
+  uint8_t input[2 * sizeof(payload) + 16];
+  size_t length = 0;
+  input[length++] = 'a';
+  input[length++] = TELNET_IAC;
+  input[length++] = TELNET_SB;
+  input[length++] = 201;
+  input[length++] = TELNET_SE_IS;
+  for (size_t i = 0; i < sizeof(payload); i++) {
+    payload[i] = (i % 37 == 0) ? TELNET_IAC : (uint8_t)('A' + i % 26);
+    input[length++] = payload[i];
+    if (payload[i] == TELNET_IAC) {
+      input[length++] = TELNET_IAC;
+    }
+  }
+  input[length++] = TELNET_IAC;
+  input[length++] = TELNET_SE;
+  input[length++] = 'b';
+
+  // Whole, in random pieces and one byte at a time, the payload arrives complete and unescaped
+  for (size_t piece = 0; piece <= 2; piece++) {
+    telnet_session_t session;
+    telnet_init(&session);
+    telnet_stream_subnegotiations(&session, &stream);
+    memset(&streamed, 0, sizeof(streamed));
+    memset(&received, 0, sizeof(received));
+    read_in_place(&session, input, length, (piece == 2) ? length : piece, &received);
+    CHECK(streamed.begins == 1 && streamed.ends == 1);
+    CHECK(streamed.option == 201 && streamed.type == TELNET_SE_IS);
+    CHECK_BYTES(streamed.data, streamed.length, payload, sizeof(payload));
+    CHECK_BYTES(received.data, received.data_length, "ab", 2);
+    CHECK(received.packets_length == 0);
+  }
+
+  // Without streaming, the same subnegotiation is cut to the size of the subnegotiation buffer
+  telnet_session_t session;
+  telnet_init(&session);
+  telnet_stream_subnegotiations(&session, &stream);
+  telnet_stream_subnegotiations(&session, NULL);
+  memset(&streamed, 0, sizeof(streamed));
+  memset(&received, 0, sizeof(received));
+  read_in_place(&session, input, length, length, &received);
+  CHECK(streamed.begins == 0 && streamed.ends == 0);
+  CHECK(received.packets_length == 4 + TELNET_SUBNEGOTIATION_BUFFER_SIZE);
+}
+
+// Build IAC SB option IS, `length` bytes of payload, IAC SE, returning the size of the stream
+static size_t subnegotiation_stream(uint8_t *stream, uint8_t *payload, size_t length) {
+  size_t size = 0;
+  stream[size++] = TELNET_IAC;
+  stream[size++] = TELNET_SB;
+  stream[size++] = TELNET_OPTION_TERMINAL_TYPE;
+  stream[size++] = TELNET_SE_IS;
+  for (size_t i = 0; i < length; i++) {
+    payload[i] = (uint8_t)('a' + i % 26);
+    stream[size++] = payload[i];
+  }
+  stream[size++] = TELNET_IAC;
+  stream[size++] = TELNET_SE;
+  return size;
+}
+
+static void test_arena_and_pool(void) {
+  static received_t received;
+  uint64_t arena_storage[32];
+  telnet_arena_t arena;
+  telnet_arena_init(&arena, arena_storage, sizeof(arena_storage));
+
+  // Arena blocks are aligned, do not overlap and run out when the storage does
+  uint8_t *first = telnet_arena_alloc(&arena, 3);
+  uint8_t *second = telnet_arena_alloc(&arena, 200);
+  CHECK(first != NULL && second != NULL && second >= first + 3);
+  CHECK((uintptr_t)second % sizeof(void *) == 0);
+  CHECK(telnet_arena_alloc(&arena, sizeof(arena_storage)) == NULL);
+  telnet_arena_reset(&arena);
+  CHECK(telnet_arena_alloc(&arena, sizeof(arena_storage)) == (void *)arena_storage);
+  telnet_arena_reset(&arena);
+
+  // Pool blocks are handed out once each, and come back when freed
+  uint8_t pool_storage[3][TELNET_POOL_BLOCK_SIZE(100)];
+  telnet_pool_t pool;
+  telnet_pool_init(&pool, pool_storage, 100, 3);
+  void *blocks[3];
+  for (int i = 0; i < 3; i++) {
+    blocks[i] = telnet_pool_alloc(&pool);
+    CHECK(blocks[i] != NULL);
+    for (int j = 0; j < i; j++) {
+      CHECK(blocks[i] != blocks[j]);
+    }
+  }
+  CHECK(telnet_pool_alloc(&pool) == NULL);
+  telnet_pool_free(&pool, blocks[1]);
+  CHECK(telnet_pool_alloc(&pool) == blocks[1]);
+  telnet_pool_free(&pool, blocks[1]);
+
+  // Subnegotiations larger than the built in buffer fit in storage from the arena or the pool
+  uint8_t stream[160];
+  uint8_t payload[100];
+  size_t length = subnegotiation_stream(stream, payload, sizeof(payload));
+  for (int source = 0; source < 2; source++) {
+    telnet_session_t session;
+    telnet_init(&session);
+    uint8_t *buffer = (source == 0) ? telnet_arena_alloc(&arena, 100) : telnet_pool_alloc(&pool);
+    telnet_set_subnegotiation_buffer(&session, buffer, 100);
+    memset(&received, 0, sizeof(received));
+    read_in_place(&session, stream, length, 0, &received);
+    CHECK(received.packets_length == 4 + sizeof(payload));
+    CHECK_BYTES(&received.packets[4], received.packets_length - 4, payload, sizeof(payload));
+  }
+
+  // A subnegotiation that does not fit is cut to the size of the buffer
+  telnet_session_t session;
+  telnet_init(&session);
+  telnet_set_subnegotiation_buffer(&session, telnet_arena_alloc(&arena, 10), 10);
+  memset(&received, 0, sizeof(received));
+  read_in_place(&session, stream, length, length, &received);
+  CHECK_BYTES(&received.packets[4], received.packets_length - 4, payload, 10);
+}
+
+// What the batch callback was given
+static struct {
+  int calls;
+  size_t counts[8];
+  int packet_calls;
+} batches;
+
+static void record_batch(telnet_session_t *session, const telnet_packet_t *packets, size_t count) {
+  (void)session;
+  if (batches.calls < 8) {
+    batches.counts[batches.calls] = count;
+  }
+  batches.calls++;
+  for (size_t i = 0; i < count; i++) {
+    const telnet_packet_t *packet = &packets[i];
+    // Only subnegotiations carry data, and theirs is still intact when the batch is delivered
+    if (packet->command != TELNET_SB) {
+      CHECK(packet->subnegotiation_data == NULL && packet->subnegotiation_length == 0);
+    }
+    log_packet(current, packet->command, packet->option, packet->subnegotiation_type, packet->subnegotiation_data,
+               packet->subnegotiation_length);
+  }
+}
+
+static bool count_packet(telnet_session_t *session, const telnet_packet_t *packet) {
+  (void)session;
+  (void)packet;
+  batches.packet_calls++;
+  return true;
+}
+
+static uint8_t replies[64];
+static size_t replies_length;
+
+static void collect_replies(telnet_session_t *session, const uint8_t *data, size_t length) {
+  (void)session;
+  if (replies_length + length <= sizeof(replies)) {
+    memcpy(&replies[replies_length], data, length);
+    replies_length += length;
+  }
+}
+
+static void test_packet_batch(void) {
+  static received_t received;
+  static received_t expected;
+  const uint8_t stream[] = { 'a', TELNET_IAC, TELNET_SB, TELNET_OPTION_TERMINAL_TYPE, TELNET_SE_IS, 'x', 'y',
+                             TELNET_IAC, TELNET_SE, TELNET_IAC, TELNET_WILL, TELNET_OPTION_ECHO, TELNET_IAC, TELNET_NOP,
+                             'b', TELNET_IAC, TELNET_SB, TELNET_OPTION_WINDOW_SIZE, TELNET_SE_IS, 'z', TELNET_IAC,
+                             TELNET_SE, TELNET_IAC, TELNET_AYT, 'c' };
+  telnet_packet_t packets[4];
+  telnet_packet_batch_t batch;
+  telnet_session_t session;
+
+  // The packets the packet callback sees one by one
+  telnet_init(&session);
+  memset(&expected, 0, sizeof(expected));
+  read_in_place(&session, stream, sizeof(stream), sizeof(stream), &expected);
+
+  // All packets of one read arrive in a single call, except that a second subnegotiation is only
+  // started once the batch holding the first one has been delivered
+  telnet_init(&session);
+  telnet_set_packet_batch(&session, &batch, packets, 4, record_batch);
+  memset(&batches, 0, sizeof(batches));
+  memset(&received, 0, sizeof(received));
+  current = &received;
+  uint8_t buffer[sizeof(stream) + 1];
+  memcpy(buffer, stream, sizeof(stream));
+  replies_length = 0;
+  append_data(&received, buffer, telnet_read(&session, buffer, sizeof(stream), count_packet, collect_replies));
+  check_same(&received, &expected);
+  CHECK(batches.calls == 2 && batches.counts[0] == 3 && batches.counts[1] == 2);
+  CHECK(batches.packet_calls == 0);
+
+  // Batched packets still get automatic replies
+  const uint8_t refusal[] = { TELNET_IAC, TELNET_DONT, TELNET_OPTION_ECHO };
+  CHECK_BYTES(replies, replies_length, refusal, sizeof(refusal));
+
+  // A full batch is delivered before the next packet is added
+  const uint8_t commands[] = { TELNET_IAC, TELNET_NOP, TELNET_IAC, TELNET_AYT, TELNET_IAC, TELNET_GA,
+                               TELNET_IAC, TELNET_NOP, TELNET_IAC, TELNET_EOR };
+  telnet_set_packet_batch(&session, &batch, packets, 2, record_batch);
+  memset(&batches, 0, sizeof(batches));
+  memcpy(buffer, commands, sizeof(commands));
+  telnet_read(&session, buffer, sizeof(commands), count_packet, collect_replies);
+  CHECK(batches.calls == 3 && batches.counts[0] == 2 && batches.counts[1] == 2 && batches.counts[2] == 1);
+
+  // Without a batch the packet callback is used again
+  telnet_set_packet_batch(&session, NULL, NULL, 0, NULL);
+  memset(&batches, 0, sizeof(batches));
+  memcpy(buffer, commands, sizeof(commands));
+  telnet_read(&session, buffer, sizeof(commands), count_packet, collect_replies);
+  CHECK(batches.calls == 0 && batches.packet_calls == 5);
+}
+
+int main(void) {
+  test_escaped_iac_split();
+  test_command_split();
+  test_subnegotiation_split();
+  test_subnegotiation_abort();
+  test_streamed_subnegotiation();
+  test_arena_and_pool();
+  test_packet_batch();
+  test_newline_split();
+  test_newline_random_splits();
+  test_random_splits();
+  return test_result("test_read");
+}